@@ -87,8 +87,13 @@ STATS=4
 ISREADY=5
 SHUTDOWN=6
 WORKER_UP_TIME_STATS=7
+HELLO=8
+SLOTS=9
+CANCEL=10
+DRAIN=11
+RETURNED=12
 
-messages = (WORK, RESPONSE, NEW_WORKER, REQUEST_STATS, STATS, ISREADY, SHUTDOWN, WORKER_UP_TIME_STATS)
+messages = (WORK, RESPONSE, NEW_WORKER, REQUEST_STATS, STATS, ISREADY, SHUTDOWN, WORKER_UP_TIME_STATS, HELLO, SLOTS, CANCEL, DRAIN, RETURNED)
 
 class TaggedMessage(CStruct):
   struct = struct.Struct("ii")
@@ -0,0 +1,249 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "comm/channel.h"
+#include "comm/comm.h"
+#include "server/messages.h"
+
+Channel::Channel(int fd) {
+  sock = fd;
+  read_buf.resize(CHANNEL_READ_SIZE);
+  read_start = 0;
+  read_end = 0;
+  last_start = 0;
+  write_start = 0;
+}
+
+int Channel::fill() {
+  // move the partial message (if any) to the front
+  if (read_start == read_end) {
+    read_start = read_end = 0;
+    last_start = 0;
+  } else if (read_start > 0) {
+    memmove(read_buf.data(), read_buf.data() + read_start,
+            read_end - read_start);
+    read_end -= read_start;
+    read_start = 0;
+    last_start = 0;
+  }
+  if (read_buf.size() - read_end < CHANNEL_READ_SIZE / 2) {
+    read_buf.resize(read_buf.size() * 2);
+  }
+
+  ssize_t ret;
+  do {
+    ret = recv(sock, read_buf.data() + read_end, read_buf.size() - read_end, 0);
+  } while (ret == -1 && errno == EINTR);
+  if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+  if (ret <= 0) {
+    return -1;
+  }
+  read_end += ret;
+  return 0;
+}
+
+/*
+ * legacy_payload_size --
+ *
+ * How a legacy message continues after its tagged_message_t: -1 for a
+ * length-prefixed payload, otherwise the size of a fixed payload.
+ */
+static int legacy_payload_size(message_t message) {
+  switch (message) {
+  case WORK:
+  case RESPONSE:
+    return -1;
+  case STATS:
+    return sizeof(worker_stats_t);
+  case SLOTS:
+    return sizeof(worker_slots_t);
+  default:
+    return 0;
+  }
+}
+
+int Channel::next(channel_msg_t* msg) {
+  const char* p = read_buf.data() + read_start;
+  size_t avail = read_end - read_start;
+  if (avail == 0) {
+    return 0;
+  }
+
+  if (static_cast<unsigned char>(*p) & WIRE_FRAME_BIT) {
+    if (avail < sizeof(wire_header_t)) {
+      return 0;
+    }
+    wire_frame_t& frame = msg->frame;
+    memcpy(&frame.header, p, sizeof(frame.header));
+    if (!valid_frame_header(frame.header)) {
+      return -1;
+    }
+    if (avail < sizeof(wire_header_t) + frame.header.body_len) {
+      return 0;
+    }
+    if (parse_frame_args(p + sizeof(wire_header_t), &frame) < 0) {
+      return -1;
+    }
+    msg->framed = true;
+    msg->message = static_cast<message_t>(frame.header.message);
+    msg->tag = frame.header.tag;
+    msg->payload = NULL;
+    msg->payload_len = 0;
+    last_start = read_start;
+    read_start += sizeof(wire_header_t) + frame.header.body_len;
+    return 1;
+  }
+
+  tagged_message_t tagged;
+  if (avail < sizeof(tagged)) {
+    return 0;
+  }
+  memcpy(&tagged, p, sizeof(tagged));
+  size_t used = sizeof(tagged);
+
+  int len = legacy_payload_size(tagged.message);
+  if (len < 0) {
+    if (avail < used + sizeof(len)) {
+      return 0;
+    }
+    memcpy(&len, p + used, sizeof(len));
+    used += sizeof(len);
+    if (len < 0 || len > WIRE_MAX_BODY) {
+      return -1;
+    }
+  }
+  if (avail < used + len) {
+    return 0;
+  }
+
+  msg->framed = false;
+  msg->message = tagged.message;
+  msg->tag = tagged.tag;
+  msg->payload = p + used;
+  msg->payload_len = len;
+  msg->frame.args.clear();
+  last_start = read_start;
+  read_start += used + len;
+  return 1;
+}
+
+void Channel::put_message(message_t message, int tag) {
+  tagged_message_t tagged;
+  tagged.message = message;
+  tagged.tag = tag;
+  write_buf.append(reinterpret_cast<const char*>(&tagged), sizeof(tagged));
+}
+
+void Channel::put_payload(message_t message, int tag, const char* data, int len) {
+  put_message(message, tag);
+  write_buf.append(reinterpret_cast<const char*>(&len), sizeof(len));
+  write_buf.append(data, len);
+}
+
+void Channel::put_fixed(message_t message, int tag, const void* data, int len) {
+  put_message(message, tag);
+  write_buf.append(static_cast<const char*>(data), len);
+}
+
+int Channel::put_frame(message_t message, int command, int tag,
+                       const wire_arg_t* args, int argc) {
+  if (argc < 0 || argc > WIRE_MAX_ARGS) {
+    return -1;
+  }
+
+  wire_header_t header;
+  header.version = WIRE_FRAME_BIT | WIRE_VERSION;
+  header.message = message;
+  header.command = command;
+  header.argc = argc;
+  header.tag = tag;
+  header.body_len = 0;
+  for (int i = 0; i < argc; i++) {
+    header.body_len += sizeof(args[i].len) + args[i].len;
+  }
+
+  write_buf.reserve(write_buf.size() + sizeof(header) + header.body_len);
+  write_buf.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (int i = 0; i < argc; i++) {
+    write_buf.append(reinterpret_cast<const char*>(&args[i].len),
+                     sizeof(args[i].len));
+    write_buf.append(args[i].data, args[i].len);
+  }
+  return 0;
+}
+
+int Channel::put_hello_frame(int tag, const worker_info_t& info) {
+  char contexts[16];
+  char llc_domains[16];
+  wire_arg_t args[4];
+  args[0].data = "contexts";
+  args[0].len = strlen(args[0].data);
+  args[1].data = contexts;
+  args[1].len = snprintf(contexts, sizeof(contexts), "%d", info.num_contexts);
+  args[2].data = "llc_domains";
+  args[2].len = strlen(args[2].data);
+  args[3].data = llc_domains;
+  args[3].len = snprintf(llc_domains, sizeof(llc_domains), "%d",
+                         info.num_llc_domains);
+  return put_frame(HELLO, 0, tag, args, 4);
+}
+
+int Channel::put_work_frame(const Request_msg& req) {
+  wire_arg_t args[WIRE_MAX_ARGS];
+  int command;
+  int argc = work_frame_args(req, args, &command);
+  if (argc < 0) {
+    return -1;
+  }
+  return put_frame(WORK, command, req.get_tag(), args, argc);
+}
+
+int Channel::put_resp_frame(const Response_msg& resp) {
+  const std::string& resp_str = resp.get_response();
+  double run_seconds = resp.get_run_seconds();
+  wire_arg_t args[2];
+  args[0].data = resp_str.data();
+  args[0].len = resp_str.size();
+  args[1].data = reinterpret_cast<const char*>(&run_seconds);
+  args[1].len = sizeof(run_seconds);
+  return put_frame(RESPONSE, 0, resp.get_tag(), args, 2);
+}
+
+void Channel::take_pending_writes(std::string* out) {
+  if (write_start > 0) {
+    write_buf.erase(0, write_start);
+    write_start = 0;
+  }
+  out->clear();
+  out->swap(write_buf);
+}
+
+int Channel::flush() {
+  while (write_start < write_buf.size()) {
+    // a peer that went away must not kill us with SIGPIPE
+    ssize_t ret = send(sock, write_buf.data() + write_start,
+                       write_buf.size() - write_start, MSG_NOSIGNAL);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    } else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // don't let a slow peer's sent bytes pile up in front
+      if (write_start > write_buf.size() / 2) {
+        write_buf.erase(0, write_start);
+        write_start = 0;
+      }
+      return 1;
+    } else if (ret <= 0) {
+      write_buf.clear();
+      write_start = 0;
+      return -1;
+    }
+    write_start += ret;
+  }
+  write_buf.clear();
+  write_start = 0;
+  return 0;
+}
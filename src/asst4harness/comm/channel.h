@@ -0,0 +1,93 @@
+#ifndef COMM_CHANNEL_H_
+#define COMM_CHANNEL_H_
+
+#include <string>
+#include <vector>
+
+#include "types/types.h"
+
+class Request_msg;
+class Response_msg;
+
+// bytes asked for by each recv; larger messages grow the buffer
+#define CHANNEL_READ_SIZE (64 * 1024)
+
+// A message taken out of a Channel's read buffer: either a frame, or a
+// legacy tagged message with its payload (if it has one).  The
+// pointers are only valid until the next Channel::fill().
+typedef struct {
+  bool framed;
+  message_t message;
+  int tag;
+  const char* payload;
+  int payload_len;
+  wire_frame_t frame;
+} channel_msg_t;
+
+/*
+ * Channel --
+ *
+ * Buffered messages on one connection.  fill() does a single recv of
+ * whatever the socket has, which may be several messages and the start
+ * of another; next() then hands out the complete ones without further
+ * syscalls and keeps the partial one for the next fill().
+ *
+ * The put_*() calls only append to the write buffer, so everything a
+ * handler sends on a connection leaves in one send when the owner
+ * calls flush() (the master does so at the end of each event loop
+ * callback).
+ *
+ * On a non-blocking socket neither side ever waits: fill() returns
+ * with nothing new if there is nothing to read, and flush() keeps what
+ * the socket would not take for a later call.
+ *
+ * A Channel does no locking.
+ */
+class Channel {
+public:
+  explicit Channel(int fd);
+
+  int fd() const { return sock; }
+
+  // Returns -1 if the connection was closed or failed.
+  int fill();
+  // Returns 1 and the next message, 0 if no complete message is
+  // buffered, or -1 if the stream is malformed.
+  int next(channel_msg_t* msg);
+  // Puts the message last returned by next() back, so the next call
+  // returns it again.
+  void unread_last() { read_start = last_start; }
+
+  void put_message(message_t message, int tag);
+  void put_payload(message_t message, int tag, const char* data, int len);
+  // A legacy message whose payload has a size fixed by its type.
+  void put_fixed(message_t message, int tag, const void* data, int len);
+  int put_frame(message_t message, int command, int tag,
+                const wire_arg_t* args, int argc);
+  int put_hello_frame(int tag, const worker_info_t& info);
+  int put_work_frame(const Request_msg& req);
+  int put_resp_frame(const Response_msg& resp);
+
+  bool has_pending_writes() const { return write_start < write_buf.size(); }
+  // Moves the pending writes into 'out', for callers that send them
+  // without holding the lock protecting the channel.
+  void take_pending_writes(std::string* out);
+  // Sends as much of the pending writes as the socket takes.  Returns
+  // 0 once everything is sent, 1 if a non-blocking socket is full and
+  // the rest is still pending, or -1 on failure.
+  int flush();
+
+private:
+  int sock;
+  std::vector<char> read_buf;
+  size_t read_start;  // first unconsumed byte
+  size_t last_start;  // where the message last returned by next() began
+  size_t read_end;    // end of received bytes
+  std::string write_buf;
+  size_t write_start;  // first unsent byte
+
+  Channel(const Channel&);
+  Channel& operator=(const Channel&);
+};
+
+#endif  // COMM_CHANNEL_H_
@@ -3,19 +3,21 @@
 #include <assert.h>
 #include <boost/make_shared.hpp>
 #include <errno.h>
+#include <stdlib.h>
 #include <sys/socket.h>
 #include <string.h>
 
 #include "comm/comm.h"
+#include "server/messages.h"
 
-static int send_all(int fd, const void* buf, size_t len) {
+int send_all(int fd, const void* buf, size_t len) {
   const char* cbuf = reinterpret_cast<const char*>(buf);
   size_t sent = 0;
   do {
     ssize_t ret = send(fd, &cbuf[sent], len - sent, 0);
-    if (ret == -1 && errno != EINTR) {
-      return -1;
-    } else if (ret == 0) {
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    } else if (ret <= 0) {
       return -1;
     }
     sent += ret;
@@ -117,3 +119,149 @@ int send_string(int fd, const std::string& s) {
   if (err < 0) return err;
   return send_all(fd, s.c_str(), len);
 }
+
+bool valid_frame_header(const wire_header_t& header) {
+  int version = header.version & ~WIRE_FRAME_BIT;
+  return (header.version & WIRE_FRAME_BIT) && version >= 1 &&
+    version <= WIRE_VERSION && header.body_len <= WIRE_MAX_BODY;
+}
+
+/*
+ * parse_frame_args --
+ *
+ * Splits a frame body of frame->header.body_len bytes into args that
+ * point into it.  Returns -1 if the body does not hold exactly
+ * header.argc args.
+ */
+int parse_frame_args(const char* body, wire_frame_t* frame) {
+  const wire_header_t& header = frame->header;
+  frame->args.resize(header.argc);
+  const char* p = body;
+  const char* end = p + header.body_len;
+  for (int i = 0; i < header.argc; i++) {
+    uint32_t len;
+    if (end - p < static_cast<ssize_t>(sizeof(len))) {
+      return -1;
+    }
+    memcpy(&len, p, sizeof(len));
+    p += sizeof(len);
+    if (static_cast<size_t>(end - p) < len) {
+      return -1;
+    }
+    frame->args[i].data = p;
+    frame->args[i].len = len;
+    p += len;
+  }
+  return (p == end) ? 0 : -1;
+}
+
+/*
+ * work_frame_args --
+ *
+ * Lays out a request as WORK frame args pointing into 'req', which
+ * must outlive them.  A known command travels as the header's command
+ * byte instead of a "cmd" arg; every other arg is a key followed by
+ * its value.  Returns the number of args, or -1 if there are too many.
+ */
+int work_frame_args(const Request_msg& req, wire_arg_t* args, int* command) {
+  int argc = 0;
+  *command = req.get_cmd();
+
+  for (int i = 0; i < req.num_args(); i++) {
+    Arg_view key = req.arg_key(i);
+    if (*command != CMD_OTHER && key == "cmd") {
+      continue;
+    }
+    if (argc + 2 > WIRE_MAX_ARGS) {
+      return -1;
+    }
+    Arg_view value = req.arg_value(i);
+    args[argc].data = key.data();
+    args[argc].len = key.size();
+    argc++;
+    args[argc].data = value.data();
+    args[argc].len = value.size();
+    argc++;
+  }
+  return argc;
+}
+
+/*
+ * frame_to_request --
+ *
+ * Builds the Request_msg carried by a WORK frame.  Returns -1 if the
+ * args do not come in key/value pairs, or there are too many.
+ */
+int frame_to_request(const wire_frame_t& frame, Request_msg* req) {
+  if (frame.args.size() % 2 != 0) {
+    return -1;
+  }
+  Arg_view keys[REQUEST_MAX_ARGS];
+  Arg_view values[REQUEST_MAX_ARGS];
+  int n = 0;
+  Request_cmd command = static_cast<Request_cmd>(frame.header.command);
+  if (command != CMD_OTHER) {
+    const char* name = request_cmd_name(command);
+    keys[n] = Arg_view("cmd", 3);
+    values[n] = Arg_view(name, strlen(name));
+    n++;
+  }
+  for (size_t i = 0; i < frame.args.size(); i += 2) {
+    if (n == REQUEST_MAX_ARGS) {
+      return -1;
+    }
+    keys[n] = Arg_view(frame.args[i].data, frame.args[i].len);
+    values[n] = Arg_view(frame.args[i + 1].data, frame.args[i + 1].len);
+    n++;
+  }
+  *req = Request_msg(frame.header.tag, keys, values, n);
+  return 0;
+}
+
+/*
+ * frame_to_hello --
+ *
+ * Reads what a worker says about itself in its HELLO frame: key/value
+ * args, of which unknown keys are skipped, so later workers can add
+ * some.  Fields it doesn't mention are 0.  Returns -1 if the args do
+ * not come in pairs.
+ */
+int frame_to_hello(const wire_frame_t& frame, worker_info_t* info) {
+  memset(info, 0, sizeof(*info));
+  if (frame.args.size() % 2 != 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < frame.args.size(); i += 2) {
+    std::string key(frame.args[i].data, frame.args[i].len);
+    std::string value(frame.args[i + 1].data, frame.args[i + 1].len);
+    if (key == "contexts") {
+      info->num_contexts = atoi(value.c_str());
+    } else if (key == "llc_domains") {
+      info->num_llc_domains = atoi(value.c_str());
+    }
+  }
+  return 0;
+}
+
+/*
+ * frame_to_response --
+ *
+ * Builds the Response_msg carried by a RESPONSE frame: the response
+ * string, optionally followed by the worker's run time (a double).
+ */
+int frame_to_response(const wire_frame_t& frame, Response_msg* resp) {
+  if (frame.args.size() < 1 || frame.args.size() > 2) {
+    return -1;
+  }
+  resp->set_tag(frame.header.tag);
+  resp->set_response(std::string(frame.args[0].data, frame.args[0].len));
+  if (frame.args.size() == 2) {
+    double run_seconds;
+    if (frame.args[1].len != sizeof(run_seconds)) {
+      return -1;
+    }
+    memcpy(&run_seconds, frame.args[1].data, sizeof(run_seconds));
+    resp->set_run_seconds(run_seconds);
+  }
+  return 0;
+}
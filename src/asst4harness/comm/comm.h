@@ -21,5 +21,21 @@ int send_resp(int fd, const resp_t& resp);
 int send_resp(int fd, const resp_t& resp, int tag);
 
 int send_string(int fd, const std::string& args);
+int send_all(int fd, const void* buf, size_t len);
+
+class Request_msg;
+class Response_msg;
+
+// Binary framing, see wire_header_t.  A peer only receives frames once
+// it has said (by sending one) that it can read them.  Frames are sent
+// and received on a Channel; these are the codec helpers it shares
+// with the master and workers.
+bool valid_frame_header(const wire_header_t& header);
+int parse_frame_args(const char* body, wire_frame_t* frame);
+int work_frame_args(const Request_msg& req, wire_arg_t* args, int* command);
+
+int frame_to_request(const wire_frame_t& frame, Request_msg* req);
+int frame_to_response(const wire_frame_t& frame, Response_msg* resp);
+int frame_to_hello(const wire_frame_t& frame, worker_info_t* info);
 
 #endif  // COMM_COMM_H_
@@ -58,12 +58,12 @@ int main(int argc, char** argv) {
   harness_init();
 
   // student code
-  int tick_seconds;
+  double tick_seconds;
   master_node_init(FLAGS_max_workers, tick_seconds);
 
   struct timeval tick_period;
-  tick_period.tv_sec = tick_seconds;
-  tick_period.tv_usec = 0;
+  tick_period.tv_sec = (long)tick_seconds;
+  tick_period.tv_usec = (long)((tick_seconds - tick_period.tv_sec) * 1e6);
 
   harness_begin_main_loop(&tick_period);
 
@@ -1,60 +1,348 @@
 // Copyright 2013 15418 Course Staff.
 // This was most helpful: http://eradman.com/posts/kqueue-tcp.html
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <boost/unordered_set.hpp>
 #include <errno.h>
-#include <event.h>
+#include <event2/event.h>
+#include <event2/event_struct.h>
+#include <fcntl.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
 #include <sys/select.h>
 #include <unistd.h>
 #include <netinet/in.h>
-#include <boost/make_shared.hpp>
 
+#include "comm/channel.h"
 #include "comm/comm.h"
 #include "types/types.h"
 #include "server/messages.h"
 #include "server/master.h"
 
 #include  "tools/cycle_timer.h"
+#include "tools/work_queue.h"
 
 #define MAX_EVENTS 1024
+// client requests and control messages waiting for the dispatcher
+#define DISPATCH_QUEUE_CAPACITY (64 * 1024)
 
 extern int launcher_fd;
 extern int accept_fd;
 
 DEFINE_bool(log_network, false, "Log network traffic.");
+DEFINE_int32(io_threads, 2, "Threads serving client connections "
+             "(0 serves them on the dispatcher thread).");
 
 #define NETLOG(level) DLOG_IF(level, FLAGS_log_network)
 
-static bool is_server_initialized = false;
+static std::atomic<bool> is_server_initialized(false);
 static int num_instances_booted = 0;
 static double total_worker_seconds;
 
 std::map<Worker_handle, double> worker_boot_times;
 boost::unordered_set<Worker_handle> workers;
 
+/*
+ * The master runs one event loop (a Reactor) per thread:
+ *
+ *  - the dispatcher, on the main thread, owns the worker connections,
+ *    the launcher, the timer and every call into the student handlers
+ *    except try_answer_client_request().  Scheduling state therefore
+ *    never needs a lock.
+ *  - io_threads I/O reactors accept and own the client connections.
+ *    They read and parse requests, answer what
+ *    try_answer_client_request() can, and pass the rest to the
+ *    dispatcher through its lock-free inbox.  Responses come back
+ *    through each I/O reactor's outbox.
+ *
+ * A new connection whose first message turns out to come from a
+ * worker is handed over to the dispatcher.  With io_threads == 0 the
+ * dispatcher does all of the above itself.
+ */
+struct Connection;
+struct Reactor;
+
+// What an I/O reactor passes to the dispatcher.
+struct Dispatch_msg {
+  enum Type { CLIENT_REQUEST, UP_TIME_STATS, SHUTDOWN_REQUEST, ADOPT };
+  Type type;
+  Connection* conn;
+  Request_msg req;
+  uint64_t fingerprint;  // CLIENT_REQUEST: from try_answer_client_request
+};
+
+// What the dispatcher passes back to an I/O reactor.
+struct Client_reply {
+  Connection* conn;
+  std::string resp;
+  bool close_after;
+};
+
+struct Reactor {
+  struct event_base* base;
+  pthread_t thread;
+
+  // written to wake the reactor when its inbox or outbox has something
+  int wakeup_fd;
+  struct event wakeup_event;
+  std::atomic<bool> wakeup_pending;
+
+  // dispatcher only: requests from I/O reactors
+  WorkQueue<Dispatch_msg*>* inbox;
+
+  // I/O reactors only: replies from the dispatcher.  The dispatcher
+  // must never block on a full queue while an I/O reactor blocks on
+  // the dispatcher's, so this one is unbounded.
+  pthread_mutex_t outbox_lock;
+  std::vector<Client_reply> outbox;
+
+  // connections with buffered writes, flushed at the end of the
+  // current callback
+  std::vector<Connection*> dirty_connections;
+  // connections closed during the current callback and no longer
+  // referenced by the dispatcher, freed at its end
+  std::vector<Connection*> closed_connections;
+  // reactors this one has queued messages for in the current callback
+  std::vector<Reactor*> reactors_to_wake;
+};
+
+// Every client and worker connection.  Client and worker handles point
+// to one of these.  The socket is non-blocking; the Channel holds
+// whatever part of a message has not been read or written yet.  A
+// connection is only ever touched by the thread of its reactor.
+struct Connection {
+  Reactor* reactor;
+  struct event read_event;
+  struct event write_event;  // added only while writes are pending
+  Channel channel;
+  int pending_replies;       // requests passed on, not yet answered
+  bool framed;   // has sent us a frame, and so can read frames
+  worker_info_t info;  // from the worker's HELLO, zeros if none
+  bool dirty;    // on dirty_connections
+  bool writing;  // write_event is added
+  bool closed;
+
+  Connection(Reactor* arg_reactor, int fd) : channel(fd) {
+    reactor = arg_reactor;
+    pending_replies = 0;
+    framed = false;
+    memset(&info, 0, sizeof(info));
+    dirty = false;
+    writing = false;
+    closed = false;
+  }
+};
+
+static Reactor dispatcher;
+static WorkQueue<Dispatch_msg*> dispatch_queue(DISPATCH_QUEUE_CAPACITY);
+static std::vector<Reactor*> io_reactors;
+static __thread Reactor* current_reactor = NULL;
+
+static void handle_read(int fd, int16_t events, void* arg);
+static void handle_write(int fd, int16_t events, void* arg);
+
+static Connection* get_connection(void* connection_handle) {
+  return reinterpret_cast<Connection*>(connection_handle);
+}
+
+static void mark_dirty(Connection* conn) {
+  if (!conn->dirty) {
+    conn->dirty = true;
+    conn->reactor->dirty_connections.push_back(conn);
+  }
+}
+
+static void wake_later(Reactor* reactor) {
+  std::vector<Reactor*>& to_wake = current_reactor->reactors_to_wake;
+  if (std::find(to_wake.begin(), to_wake.end(), reactor) == to_wake.end()) {
+    to_wake.push_back(reactor);
+  }
+}
+
+static void wake(Reactor* reactor) {
+  if (!reactor->wakeup_pending.exchange(true)) {
+    uint64_t one = 1;
+    PLOG_IF(ERROR, write(reactor->wakeup_fd, &one, sizeof(one)) < 0)
+      << "Cannot wake reactor";
+  }
+}
+
+/*
+ * flush_connection --
+ *
+ * Sends what the socket takes without blocking.  If some is left, the
+ * write event finishes the job once the peer catches up, so a slow
+ * peer delays only its own messages.  Returns -1 if the connection
+ * failed (see fail_connection).
+ */
+static int flush_connection(Connection* conn) {
+  int ret = conn->channel.flush();
+  if (ret > 0 && !conn->writing) {
+    event_add(&conn->write_event, NULL);
+    conn->writing = true;
+  } else if (ret <= 0 && conn->writing) {
+    event_del(&conn->write_event);
+    conn->writing = false;
+  }
+  return ret < 0 ? -1 : 0;
+}
+
+static void close_connection(void* connection_handle);
+
+/*
+ * fail_connection --
+ *
+ * Called when a send failed, i.e. the peer is gone, or when a client
+ * broke the protocol.  A client's connection is closed, and the
+ * answers to whatever it still has pending are dropped when they come.
+ * Losing a worker is fatal, as it always was: the requests sent to it
+ * can't be answered any more.
+ */
+static void fail_connection(Connection* conn) {
+  int fd = conn->channel.fd();
+  CHECK(conn->reactor != &dispatcher || workers.find(conn) == workers.end())
+    << "Lost connection to worker " << fd;
+  NETLOG(WARNING) << "Closing failed connection " << fd;
+  close_connection(conn);
+}
+
+/*
+ * finish_callback --
+ *
+ * Sends everything the callback buffered, in one send per connection,
+ * wakes the reactors it queued messages for, and frees the
+ * connections it closed.
+ */
+static void finish_callback() {
+  Reactor* self = current_reactor;
+  std::vector<Connection*> dirty;
+  dirty.swap(self->dirty_connections);
+  for (size_t i = 0; i < dirty.size(); i++) {
+    Connection* conn = dirty[i];
+    conn->dirty = false;
+    if (flush_connection(conn) < 0) {
+      fail_connection(conn);
+    }
+  }
+
+  for (size_t i = 0; i < self->reactors_to_wake.size(); i++) {
+    wake(self->reactors_to_wake[i]);
+  }
+  self->reactors_to_wake.clear();
+
+  for (size_t i = 0; i < self->closed_connections.size(); i++) {
+    delete self->closed_connections[i];
+  }
+  self->closed_connections.clear();
+}
+
 static void close_connection(void* connection_handle) {
-  struct event* event = reinterpret_cast<struct event*>(connection_handle);
-  CHECK_NE(EVENT_FD(event), accept_fd) << "Critical connection failed\n";
-  CHECK_NE(EVENT_FD(event), launcher_fd) << "Critical connection failed\n";
+  Connection* conn = get_connection(connection_handle);
+  int fd = conn->channel.fd();
+  CHECK_NE(fd, accept_fd) << "Critical connection failed\n";
+  CHECK_NE(fd, launcher_fd) << "Critical connection failed\n";
+  CHECK(conn->reactor == current_reactor)
+    << "Connection " << fd << " closed off its reactor";
 
   // We should never call close_connection() on a worker handle, because
   // kill_worker() first removes the worker from the worker set and then
-  // we remove it from the event loop here.
-  CHECK(workers.find(connection_handle) == workers.end())
-    << "Unexpected close of worker handle " << EVENT_FD(event);
+  // we remove it from the event loop here.  (Only the dispatcher owns
+  // worker connections, or may look at the set.)
+  CHECK(conn->reactor != &dispatcher ||
+        workers.find(connection_handle) == workers.end())
+    << "Unexpected close of worker handle " << fd;
+
+  NETLOG(INFO) << "Connection closed " << fd;
+
+  // whatever was sent to it in this callback goes out, as far as the
+  // socket takes it right now
+  std::vector<Connection*>& dirty = conn->reactor->dirty_connections;
+  if (conn->dirty) {
+    flush_connection(conn);
+    dirty.erase(std::find(dirty.begin(), dirty.end(), conn));
+    conn->dirty = false;
+  }
+
+  PLOG_IF(ERROR, close(fd))
+    << "Error closing fd " << fd;
+  LOG_IF(ERROR, event_del(&conn->read_event) < 0)
+    << "Error deleting event " << fd;
+  if (conn->writing) {
+    event_del(&conn->write_event);
+    conn->writing = false;
+  }
+  conn->closed = true;
+  // the dispatcher may still answer requests it got from this
+  // connection; the last answer frees it
+  if (conn->pending_replies == 0) {
+    conn->reactor->closed_connections.push_back(conn);
+  }
+}
+
+/*
+ * reply_to_client --
+ *
+ * Buffers a legacy response on a client connection owned by the
+ * calling reactor.  'answers_pending' says whether it answers a
+ * request that was passed to the dispatcher.
+ */
+static void reply_to_client(Connection* conn, const std::string& resp_str,
+                            bool close_after, bool answers_pending) {
+  if (answers_pending) {
+    conn->pending_replies--;
+  }
+  if (conn->closed) {
+    if (conn->pending_replies == 0 && answers_pending) {
+      conn->reactor->closed_connections.push_back(conn);
+    }
+    return;
+  }
+
+  NETLOG(INFO) << "Sending response " << resp_str << " to " << conn->channel.fd();
+  conn->channel.put_payload(RESPONSE, 0, resp_str.data(), resp_str.size());
+  mark_dirty(conn);
+  if (close_after) {
+    close_connection(conn);
+  }
+}
 
-  NETLOG(INFO) << "Connection closed " << EVENT_FD(event);
+// Called on the dispatcher for a request it got from a client.
+static void reply_from_dispatcher(Connection* conn, const std::string& resp_str,
+                                  bool close_after) {
+  if (conn->reactor == &dispatcher) {
+    reply_to_client(conn, resp_str, close_after, true);
+    return;
+  }
+
+  Client_reply reply;
+  reply.conn = conn;
+  reply.resp = resp_str;
+  reply.close_after = close_after;
+  pthread_mutex_lock(&conn->reactor->outbox_lock);
+  conn->reactor->outbox.push_back(reply);
+  pthread_mutex_unlock(&conn->reactor->outbox_lock);
+  wake_later(conn->reactor);
+}
 
-  PLOG_IF(ERROR, close(EVENT_FD(event)))
-    << "Error closing fd " << EVENT_FD(event);
-  LOG_IF(ERROR, event_del(event) < 0)
-    << "Error deleting event " << EVENT_FD(event);
-  delete event;
+// Called on an I/O reactor.
+static void post_to_dispatcher(Connection* conn, Dispatch_msg::Type type,
+                               Request_msg* req, uint64_t fingerprint = 0) {
+  Dispatch_msg* msg = new Dispatch_msg();
+  msg->type = type;
+  msg->conn = conn;
+  if (req) {
+    msg->req = std::move(*req);
+  }
+  msg->fingerprint = fingerprint;
+  dispatcher.inbox->put_work(msg);
+  wake_later(&dispatcher);
 }
 
 unsigned pending_worker_requests = 0;
@@ -67,6 +355,9 @@ void request_new_worker_node(const Request_msg& req) {
   char tmp_buffer[32];
   sprintf(tmp_buffer, "%d", req.get_tag());
   modified.set_arg("tag", tmp_buffer);
+  // let the worker know it may switch to the binary framing
+  sprintf(tmp_buffer, "%d", WIRE_VERSION);
+  modified.set_arg("wire_version", tmp_buffer);
 
   std::string str = modified.get_request_string();
 
@@ -94,40 +385,45 @@ void kill_worker_node(Worker_handle worker_handle) {
 }
 
 void send_request_to_worker(Client_handle worker_handle, const Request_msg& job) {
-  work_t comm_work;
-
-  std::string contents = job.get_request_string();
-  int allocation_size = contents.size();
-  comm_work.buf = boost::make_shared<char[]>(allocation_size);
-  comm_work.buf_len = allocation_size;
-  strncpy(comm_work.buf.get(), contents.c_str(), allocation_size);
-
-  // now perform the send
   CHECK(workers.find(worker_handle) != workers.end())
     << "Attempt to send work to invalid worker";
-  // TODO(awreece) Lock the worker handle!
-  struct event* event = reinterpret_cast<struct event*>(worker_handle);
-  NETLOG(INFO) << "Sending work (" << job.get_tag() << "," << comm_work << ") to "
-               << EVENT_FD(event);
-  CHECK_EQ(send_work(EVENT_FD(event), comm_work, job.get_tag()), 0)
-    << "Unexpected connection failure with worker " << EVENT_FD(event);
+  Connection* conn = get_connection(worker_handle);
+
+  if (conn->framed) {
+    NETLOG(INFO) << "Sending work frame (" << job.get_tag() << ","
+                 << job.get_request_string() << ") to " << conn->channel.fd();
+    CHECK_EQ(conn->channel.put_work_frame(job), 0)
+      << "Cannot frame work for worker " << conn->channel.fd();
+  } else {
+    std::string contents = job.get_request_string();
+    NETLOG(INFO) << "Sending work (" << job.get_tag() << "," << contents
+                 << ") to " << conn->channel.fd();
+    conn->channel.put_payload(WORK, job.get_tag(), contents.data(),
+                              contents.size());
+  }
+  mark_dirty(conn);
 }
 
-void send_client_response(Client_handle client_handle, const Response_msg& resp) {
-
-  resp_t comm_resp;
+void cancel_worker_request(Worker_handle worker_handle, int tag) {
+  CHECK(workers.find(worker_handle) != workers.end())
+    << "Attempt to cancel work on invalid worker";
+  Connection* conn = get_connection(worker_handle);
+  NETLOG(INFO) << "Cancelling " << tag << " on " << conn->channel.fd();
+  conn->channel.put_message(CANCEL, tag);
+  mark_dirty(conn);
+}
 
-  std::string resp_str = resp.get_response();
-  int allocation_size = resp_str.size();
-  comm_resp.buf = boost::make_shared<char[]>(allocation_size);
-  comm_resp.buf_len = allocation_size;
-  strncpy(comm_resp.buf.get(), resp_str.c_str(), allocation_size);
+void drain_worker_node(Worker_handle worker_handle) {
+  CHECK(workers.find(worker_handle) != workers.end())
+    << "Attempt to drain invalid worker";
+  Connection* conn = get_connection(worker_handle);
+  NETLOG(INFO) << "Draining " << conn->channel.fd();
+  conn->channel.put_message(DRAIN, 0);
+  mark_dirty(conn);
+}
 
-  // send to comm layer
-  struct event* event = reinterpret_cast<struct event*>(client_handle);
-  NETLOG(INFO) << "Sending response " << comm_resp << " to " << EVENT_FD(event);
-  CHECK_EQ(send_resp(EVENT_FD(event), comm_resp, 0), 0)
-    << "Unexpected connection failure with client " << EVENT_FD(event);
+void send_client_response(Client_handle client_handle, const Response_msg& resp) {
+  reply_from_dispatcher(get_connection(client_handle), resp.get_response(), false);
 }
 
 void server_init_complete() {
@@ -140,124 +436,224 @@ static void shutdown() {
 }
 
 bool should_shutdown = false;
-static void handle_read(int fd, int16_t events, void* arg) {
-  assert(events & EV_READ);
-  message_t message;
-  int tag;
-  int err = recv_message(fd, &message, &tag);
-  if (err < 0) {
-    NETLOG(WARNING) << "Connection closed on " << fd;
-    close_connection(arg);
-    return;
+static void handle_shutdown_request() {
+  if (pending_worker_requests == 0) {
+    shutdown();
+  } else {
+    should_shutdown = true;
   }
+}
 
-  NETLOG(INFO) << "Got message (" << message << "," << tag << ")";
+static void handle_up_time_stats(Connection* conn) {
+  // Accumulate time for all the workers that HAVE NOT yet been shut
+  // down
+  for (std::map<Worker_handle, double>::const_iterator it=worker_boot_times.begin();
+       it != worker_boot_times.end(); it++)
+    accumulate_time(it->first);
 
-  switch (message) {
+  char tmp_buffer[128];
+  sprintf(tmp_buffer,"%d %.2f", num_instances_booted, total_worker_seconds);
 
-  case ISREADY: {
+  reply_from_dispatcher(conn, tmp_buffer, true);
+}
 
-    resp_t comm_resp;
-    std::string resp_str( is_server_initialized ? "ready" : "not_ready" );
+/*
+ * handle_client_work --
+ *
+ * Answers a client request on the connection's own reactor if the
+ * student code can, and otherwise passes it to handle_client_request
+ * on the dispatcher.
+ */
+static void handle_client_work(Connection* conn, Request_msg& client_req) {
+  Response_msg resp;
+  uint64_t fingerprint = 0;
+  if (try_answer_client_request(client_req, resp, fingerprint)) {
+    reply_to_client(conn, resp.get_response(), false, false);
+    return;
+  }
+
+  conn->pending_replies++;
+  if (current_reactor == &dispatcher) {
+    handle_client_request(conn, client_req, fingerprint);
+  } else {
+    post_to_dispatcher(conn, Dispatch_msg::CLIENT_REQUEST, &client_req,
+                       fingerprint);
+  }
+}
 
-    int allocation_size = resp_str.size();
-    comm_resp.buf = boost::make_shared<char[]>(allocation_size);
-    comm_resp.buf_len = allocation_size;
-    strncpy(comm_resp.buf.get(), resp_str.c_str(), allocation_size);
+/*
+ * adopt_connection --
+ *
+ * Moves a connection that turned out to be a worker from an I/O
+ * reactor to the dispatcher.  Called on the I/O reactor; the message
+ * that gave it away is still unread in its Channel.  Whatever this
+ * reactor buffered for it is sent first, as far as the socket takes
+ * it, and the connection leaves this reactor's dirty list: from now on
+ * only the dispatcher may touch it.
+ */
+static void adopt_connection(Connection* conn) {
+  NETLOG(INFO) << "Handing worker connection " << conn->channel.fd()
+               << " to the dispatcher";
+  if (conn->dirty) {
+    std::vector<Connection*>& dirty = conn->reactor->dirty_connections;
+    flush_connection(conn);
+    dirty.erase(std::find(dirty.begin(), dirty.end(), conn));
+    conn->dirty = false;
+  }
+  event_del(&conn->read_event);
+  if (conn->writing) {
+    event_del(&conn->write_event);
+    conn->writing = false;
+  }
+  conn->reactor = &dispatcher;
+  post_to_dispatcher(conn, Dispatch_msg::ADOPT, NULL);
+}
 
-    // send to comm layer
-    struct event* event = reinterpret_cast<struct event*>(arg);
-    NETLOG(INFO) << "Sending response " << comm_resp << " to " << EVENT_FD(event);
-    CHECK_EQ(send_resp(EVENT_FD(event), comm_resp, 0), 0)
-      << "Unexpected connection failure with client " << EVENT_FD(event);
+/*
+ * handle_frame --
+ *
+ * Handles one binary frame.  The request or response is built straight
+ * from the frame's args, without the intermediate work_t/resp_t.
+ */
+static void handle_frame(Connection* conn, const wire_frame_t& frame) {
+  int fd = conn->channel.fd();
+  NETLOG(INFO) << "Got " << frame << " from " << fd;
+  conn->framed = true;
+
+  switch (frame.header.message) {
+
+  case HELLO:
+    if (frame_to_hello(frame, &conn->info) < 0) {
+      NETLOG(ERROR) << "Malformed hello frame from " << fd;
+      close_connection(conn);
+      return;
+    }
+    NETLOG(INFO) << "Worker on " << fd << " has " << conn->info;
+    break;
 
-    close_connection(arg);
+  case WORK: {
+    Request_msg client_req;
+    if (frame_to_request(frame, &client_req) < 0) {
+      NETLOG(ERROR) << "Malformed work frame from " << fd;
+      close_connection(conn);
+      return;
+    }
+    client_req.set_tag(0);
+    handle_client_work(conn, client_req);
     break;
   }
 
-  case WORKER_UP_TIME_STATS: {
+  case RESPONSE: {
+    Response_msg resp;
+    if (frame_to_response(frame, &resp) < 0) {
+      NETLOG(ERROR) << "Malformed response frame from " << fd;
+      close_connection(conn);
+      return;
+    }
+    handle_worker_response(conn, resp);
+    break;
+  }
+
+  default:
+    NETLOG(ERROR) << "Unexpected frame " << frame << " from " << fd;
+    close_connection(conn);
+    return;
+  }
+}
+
+// The messages a worker opens its connection with.  They hand the
+// connection to the dispatcher.
+static bool is_worker_handshake(const channel_msg_t& msg) {
+  return msg.message == NEW_WORKER || msg.message == HELLO;
+}
+
+// Messages that only a worker sends after its handshake, and so are
+// only handled on the dispatcher.
+static bool is_worker_message(const channel_msg_t& msg) {
+  return msg.message == RESPONSE || msg.message == SLOTS ||
+    msg.message == RETURNED || msg.message == DRAINED;
+}
 
-    // Accumulate time for all the workers that HAVE NOT yet been shut
-    // down
-    for (std::map<Worker_handle, double>::const_iterator it=worker_boot_times.begin();
-         it != worker_boot_times.end(); it++)
-      accumulate_time(it->first);
+static void handle_message(Connection* conn, const channel_msg_t& msg) {
+  if (msg.framed) {
+    handle_frame(conn, msg.frame);
+    return;
+  }
 
-    resp_t comm_resp;
+  int fd = conn->channel.fd();
+  message_t message = msg.message;
+  int tag = msg.tag;
 
-    char tmp_buffer[128];
-    sprintf(tmp_buffer,"%d %.2f", num_instances_booted, total_worker_seconds);
-    std::string resp_str(tmp_buffer);
+  NETLOG(INFO) << "Got message (" << message << "," << tag << ")";
 
-    int allocation_size = resp_str.size();
-    comm_resp.buf = boost::make_shared<char[]>(allocation_size);
-    comm_resp.buf_len = allocation_size;
-    strncpy(comm_resp.buf.get(), resp_str.c_str(), allocation_size);
+  switch (message) {
 
-    // send to comm layer
-    struct event* event = reinterpret_cast<struct event*>(arg);
-    NETLOG(INFO) << "Sending response " << comm_resp << " to " << EVENT_FD(event);
-    CHECK_EQ(send_resp(EVENT_FD(event), comm_resp, 0), 0)
-      << "Unexpected connection failure with client " << EVENT_FD(event);
+  case ISREADY: {
+    reply_to_client(conn, is_server_initialized ? "ready" : "not_ready",
+                    true, false);
+    break;
+  }
 
-    close_connection(arg);
+  case WORKER_UP_TIME_STATS: {
+    conn->pending_replies++;
+    if (current_reactor == &dispatcher) {
+      handle_up_time_stats(conn);
+    } else {
+      post_to_dispatcher(conn, Dispatch_msg::UP_TIME_STATS, NULL);
+    }
     break;
   }
 
     case SHUTDOWN: {
-      if (pending_worker_requests == 0) {
-  shutdown();
+      if (current_reactor == &dispatcher) {
+        handle_shutdown_request();
       } else {
-  should_shutdown = true;
+        post_to_dispatcher(conn, Dispatch_msg::SHUTDOWN_REQUEST, NULL);
       }
+      break;
     }
     case WORK: {
       // A new request from a client.
-      work_t work;
-      // TODO(awreece) This *ought* to be a buffered read.
-      if (recv_work(fd, &work) < 0) {
-        NETLOG(ERROR) << "Unexpected connection close on " << fd;
-        close_connection(arg);
-        return;
-      }
-      NETLOG(INFO) << "Got new work " << work << " from " << fd;
+      NETLOG(INFO) << "Got new work (len=" << msg.payload_len << ") from " << fd;
 
-      // HACK(kayvonf): convert a work_t into a Request_msg to pass to student code
-      // Since the content in work_t.buf is not null terminated, this is a big mess
-      int len = work.buf_len;
-      char* tmp_buffer = new char[len+1];
-      strncpy(tmp_buffer, work.buf.get(), len);
-      tmp_buffer[len] = '\0';
+      // convert the payload into a Request_msg to pass to student code
+      Request_msg client_req(0, std::string(msg.payload, msg.payload_len));
 
-      Request_msg client_req(0, tmp_buffer);
-      delete [] tmp_buffer;
-
-      handle_client_request(arg, client_req);
+      handle_client_work(conn, client_req);
       break;
     }
 
     case RESPONSE: {
       // Worker job is done response.
-      resp_t comm_resp;
-      if (recv_resp(fd, &comm_resp) < 0) {
-        NETLOG(ERROR) << "Unexpected connection close on " << fd;
-        close_connection(arg);
-        return;
-      }
-      NETLOG(INFO) << "Got worker response (" << tag << "," << comm_resp
-        << ") from " << fd;
-
-      // HACK(kayvonf): convert a resp_t into a Response_msg to pass to student code
-      // Since the content in resp_t.buf is not null terminated, this is a big mess
-      int len = comm_resp.buf_len;
-      char* tmp_buffer = new char[len+1];
-      strncpy(tmp_buffer, comm_resp.buf.get(), len);
-      tmp_buffer[len] = '\0';
+      NETLOG(INFO) << "Got worker response (" << tag << ",len="
+        << msg.payload_len << ") from " << fd;
+
+      // convert the payload into a Response_msg to pass to student code
       Response_msg resp(tag);
-      resp.set_response(tmp_buffer);
-      delete [] tmp_buffer;
+      resp.set_response(std::string(msg.payload, msg.payload_len));
+
+      handle_worker_response(conn, resp);
+      break;
+    }
+
+    case SLOTS: {
+      worker_slots_t slots;
+      memcpy(&slots, msg.payload, sizeof(slots));
+      NETLOG(INFO) << "Got " << slots << " from " << fd;
+      handle_worker_slots(conn, slots.cpu_slots, slots.cache_slots,
+                          slots.light_slots);
+      break;
+    }
+
+    case RETURNED: {
+      NETLOG(INFO) << "Got back " << msg.tag << " from " << fd;
+      handle_worker_returned(conn, msg.tag);
+      break;
+    }
 
-      handle_worker_response(arg, resp);
+    case DRAINED: {
+      NETLOG(INFO) << "Drain done on " << fd;
+      handle_worker_drained(conn);
       break;
     }
 
@@ -266,23 +662,89 @@ static void handle_read(int fd, int16_t events, void* arg) {
       if (should_shutdown && pending_worker_requests == 0) {
   shutdown();
       }
-      // Notification that a worker has booted.
+      // Notification that a worker has booted.  What it runs on came
+      // in its HELLO, if it sent one.
       NETLOG(INFO) << "New worker " << tag << " on " << fd;
-      workers.insert(arg);
-      worker_boot_times[arg] = CycleTimer::currentSeconds();
+      workers.insert(conn);
+      worker_boot_times[conn] = CycleTimer::currentSeconds();
       num_instances_booted++;
-      handle_new_worker_online(arg, tag);
+      handle_new_worker_online(conn, tag, conn->info.num_contexts,
+                               conn->info.num_llc_domains);
       break;
     }
 
     default: {
       NETLOG(ERROR) << "Unexpected message " << message << " from " << fd;
-      close_connection(arg);
+      close_connection(conn);
       return;
     }
   }
 }
 
+/*
+ * drain_connection --
+ *
+ * Handles every complete message buffered on the connection.  A
+ * partial message stays buffered until the rest arrives.
+ */
+static void drain_connection(Connection* conn) {
+  int fd = conn->channel.fd();
+  channel_msg_t msg;
+  int ret;
+  while (!conn->closed && (ret = conn->channel.next(&msg)) != 0) {
+    if (ret < 0) {
+      NETLOG(ERROR) << "Malformed message from " << fd;
+      close_connection(conn);
+      break;
+    }
+    if (current_reactor != &dispatcher && is_worker_handshake(msg)) {
+      conn->channel.unread_last();
+      adopt_connection(conn);
+      break;
+    }
+    if (current_reactor != &dispatcher && is_worker_message(msg)) {
+      NETLOG(ERROR) << "Unexpected " << msg.message << " from client " << fd;
+      fail_connection(conn);
+      break;
+    }
+    handle_message(conn, msg);
+  }
+}
+
+static void handle_read(int fd, int16_t events, void* arg) {
+  assert(events & EV_READ);
+  Connection* conn = get_connection(arg);
+
+  if (conn->channel.fill() < 0) {
+    NETLOG(WARNING) << "Connection closed on " << fd;
+    close_connection(conn);
+  } else {
+    drain_connection(conn);
+  }
+
+  finish_callback();
+}
+
+static void handle_write(int fd, int16_t events, void* arg) {
+  (void)fd;
+  assert(events & EV_WRITE);
+  Connection* conn = get_connection(arg);
+  if (flush_connection(conn) < 0) {
+    fail_connection(conn);
+  }
+
+  finish_callback();
+}
+
+static void add_connection(Reactor* reactor, Connection* conn) {
+  int fd = conn->channel.fd();
+  event_assign(&conn->read_event, reactor->base, fd, EV_READ|EV_PERSIST,
+               handle_read, conn);
+  event_assign(&conn->write_event, reactor->base, fd, EV_WRITE|EV_PERSIST,
+               handle_write, conn);
+  event_add(&conn->read_event, NULL);
+}
+
 static void handle_accept(int fd, int16_t events, void* arg) {
   (void)arg;
   assert(events & EV_READ);
@@ -291,19 +753,77 @@ static void handle_accept(int fd, int16_t events, void* arg) {
   socklen_t addr_len = sizeof(addr);
   fd = accept(fd, &addr, &addr_len);
 
+  // every I/O reactor listens, so another may have won the race
+  if (fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
   PCHECK(fd >= 0) << "Failure accepting new connection!";
   NETLOG(INFO) << "New connection on " << fd;
 
-  // So I *ought* to use bufferevents, but they change the API significantly. I
-  // think I'll go for readability here over what I suspect is a negligable
-  // improvement in performance.
-  // TODO(awreece) Use bufferevents?
+  // Nothing ever waits on a connection: reads take what is there and
+  // writes leave what doesn't fit to the write event.
+  int flags = fcntl(fd, F_GETFL, 0);
+  PCHECK(flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0)
+    << "Cannot make connection " << fd << " non-blocking";
+
+  // Send the connection as arg to make it easy to stop the event.
+  add_connection(current_reactor, new Connection(current_reactor, fd));
+}
+
+/*
+ * handle_wakeup --
+ *
+ * Runs what other reactors queued for this one: on the dispatcher,
+ * client requests and adopted connections; on an I/O reactor, replies
+ * to its clients.
+ */
+static void handle_wakeup(int fd, int16_t events, void* arg) {
+  (void)events;
+  Reactor* self = static_cast<Reactor*>(arg);
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    PLOG(ERROR) << "Cannot read wakeup fd";
+  }
+  // clear the flag before looking, so a message queued from now on
+  // wakes us again
+  self->wakeup_pending.exchange(false);
+
+  if (self == &dispatcher) {
+    Dispatch_msg* msg;
+    while (self->inbox->try_get_work(msg)) {
+      switch (msg->type) {
+      case Dispatch_msg::CLIENT_REQUEST:
+        handle_client_request(msg->conn, msg->req, msg->fingerprint);
+        break;
+      case Dispatch_msg::UP_TIME_STATS:
+        handle_up_time_stats(msg->conn);
+        break;
+      case Dispatch_msg::SHUTDOWN_REQUEST:
+        handle_shutdown_request();
+        break;
+      case Dispatch_msg::ADOPT:
+        add_connection(&dispatcher, msg->conn);
+        // the rest of what the I/O reactor couldn't send
+        if (msg->conn->channel.has_pending_writes()) {
+          mark_dirty(msg->conn);
+        }
+        drain_connection(msg->conn);
+        break;
+      }
+      delete msg;
+    }
+  } else {
+    std::vector<Client_reply> replies;
+    pthread_mutex_lock(&self->outbox_lock);
+    replies.swap(self->outbox);
+    pthread_mutex_unlock(&self->outbox_lock);
+    for (size_t i = 0; i < replies.size(); i++) {
+      reply_to_client(replies[i].conn, replies[i].resp,
+                      replies[i].close_after, true);
+    }
+  }
 
-  // Send event struct as arg to make it easy to stop the event.
-  struct event* event = new struct event;
-  // I would really rather use event_self_cbarg().
-  event_set(event, fd, EV_READ|EV_PERSIST, handle_read, event);
-  event_add(event, NULL);
+  finish_callback();
 }
 
 static void handle_timer(int fd, int16_t events, void* arg) {
@@ -313,6 +833,33 @@ static void handle_timer(int fd, int16_t events, void* arg) {
 
   NETLOG(INFO) << "Timer tick";
   handle_tick();
+  finish_callback();
+}
+
+static void init_reactor(Reactor* reactor) {
+  reactor->base = event_base_new();
+  CHECK(reactor->base != NULL) << "Cannot create event base";
+  reactor->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  PCHECK(reactor->wakeup_fd >= 0) << "Cannot create wakeup fd";
+  reactor->wakeup_pending = false;
+  reactor->inbox = NULL;
+  pthread_mutex_init(&reactor->outbox_lock, NULL);
+  event_assign(&reactor->wakeup_event, reactor->base, reactor->wakeup_fd,
+               EV_READ|EV_PERSIST, handle_wakeup, reactor);
+  event_add(&reactor->wakeup_event, NULL);
+}
+
+static void* io_reactor_start(void* arg) {
+  Reactor* self = static_cast<Reactor*>(arg);
+  current_reactor = self;
+
+  struct event accept_event;
+  event_assign(&accept_event, self->base, accept_fd, EV_READ|EV_PERSIST,
+               handle_accept, NULL);
+  event_add(&accept_event, NULL);
+
+  event_base_dispatch(self->base);
+  return NULL;
 }
 
 void harness_init() {
@@ -321,18 +868,33 @@ void harness_init() {
 }
 
 void harness_begin_main_loop(struct timeval* tick_period) {
-  event_init();
+  init_reactor(&dispatcher);
+  dispatcher.inbox = &dispatch_queue;
+  current_reactor = &dispatcher;
   struct event accept_event, timer_event;
 
-  // Set up the accept event.
-  event_set(&accept_event, accept_fd, EV_READ|EV_PERSIST,
-            handle_accept, &accept_event);
-  event_add(&accept_event, NULL);
+  // Set up the accept event, on the I/O reactors if there are any.
+  if (FLAGS_io_threads > 0) {
+    int flags = fcntl(accept_fd, F_GETFL, 0);
+    PCHECK(flags >= 0 && fcntl(accept_fd, F_SETFL, flags | O_NONBLOCK) == 0)
+      << "Cannot make listening socket non-blocking";
+    for (int i = 0; i < FLAGS_io_threads; i++) {
+      Reactor* reactor = new Reactor();
+      init_reactor(reactor);
+      io_reactors.push_back(reactor);
+      pthread_create(&reactor->thread, NULL, io_reactor_start, reactor);
+    }
+  } else {
+    event_assign(&accept_event, dispatcher.base, accept_fd, EV_READ|EV_PERSIST,
+                 handle_accept, NULL);
+    event_add(&accept_event, NULL);
+  }
 
   // Set up the timer event.
-  event_set(&timer_event, -1, EV_PERSIST, handle_timer, NULL);
+  event_assign(&timer_event, dispatcher.base, -1, EV_PERSIST, handle_timer, NULL);
   event_add(&timer_event, tick_period);
 
-  NETLOG(INFO) << "Starting event loop";
-  event_dispatch();
+  NETLOG(INFO) << "Starting event loop with " << FLAGS_io_threads
+               << " I/O threads";
+  event_base_dispatch(dispatcher.base);
 }
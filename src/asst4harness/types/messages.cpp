@@ -1,182 +1,347 @@
 // Copyright 2013 15418 Course Staff.
 
-#include <map>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <string>
-#include <sstream>
+#include <utility>
 
 #include "server/messages.h"
 #include "types/types.h"
 
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n';
+}
+
 /*
- * Trim --
+ * trim --
  *
- * Returns the input string 'str' after removing leading and trailing
- * whitespace.
+ * Returns the text between 'begin' and 'end' without leading and
+ * trailing whitespace.
  */
-std::string
-Trim(const std::string& str) {
-  size_t pos1 = str.find_first_not_of(" \t\n");
-  size_t pos2 = str.find_last_not_of(" \t\n");
+static Arg_view trim(const char* begin, const char* end) {
+  while (begin < end && is_space(*begin))
+    begin++;
+  while (end > begin && is_space(end[-1]))
+    end--;
+  return Arg_view(begin, end - begin);
+}
 
-  if (pos1 == std::string::npos)
-    return "";
-  else if (pos2 == std::string::npos)
-    return str.substr(pos1);
-  else
-    return str.substr(pos1, pos2-pos1+1);
+static bool same_text(const Arg_view& a, const Arg_view& b) {
+  return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
 }
 
-/*
- * ParseKeyValue --
- *
- * Parse the source string into a key-value pair, where '=' seperates
- * the key from the value.  Returns true if parsing is successful.
- * Return false if the source string 'str' is not a proper key-value
- * pair
- */
-bool
-ParseKeyValue(std::string& key, std::string& value, const std::string& str) {
-  size_t pos = str.find('=');
-
-  // invalid format if there's no key, no value, or no '='
-  if (pos == 0 ||
-      pos + 1 == str.size() ||
-      pos == std::string::npos) {
-    key = "";
-    value = "";
-    return false;
-  }
+// orders keys the way std::string's operator< does
+static bool key_less(const Arg_view& a, const Arg_view& b) {
+  size_t n = (a.size() < b.size()) ? a.size() : b.size();
+  int c = memcmp(a.data(), b.data(), n);
+  return c < 0 || (c == 0 && a.size() < b.size());
+}
 
-  key = Trim(str.substr(0, pos));
-  value = Trim(str.substr(pos+1));
-  return true;
+// Sets keys[i] to 'value' if keys already holds 'key', else appends
+// the pair.  Returns the new number of pairs, or -1 if there is no
+// room for another.
+static int put_arg(Arg_view* keys, Arg_view* values, int n,
+                   const Arg_view& key, const Arg_view& value) {
+  for (int i = 0; i < n; i++) {
+    if (same_text(keys[i], key)) {
+      values[i] = value;
+      return n;
+    }
+  }
+  if (n == REQUEST_MAX_ARGS)
+    return -1;
+  keys[n] = key;
+  values[n] = value;
+  return n + 1;
 }
 
-class StringTokenizer {
+std::ostream& operator<<(std::ostream& out, const Arg_view& view) {
+  return out.write(view.data(), view.size());
+}
 
-  public:
-  StringTokenizer(const std::string& str, const std::string& delimiters);
-  void Reset();
-  bool NoMoreTokens() const;
-  std::string NextToken();
+static const char* request_cmd_names[NUM_REQUEST_CMDS] = {
+  "",
+  "418wisdom",
+  "countprimes",
+  "compareprimes",
+  "projectidea",
+  "tellmenow",
+  "lastrequest",
+  "countprimesrange",
+  "bandwidth"
+};
 
-private:
-  std::string sourceStr;
-  std::string delimiters;
-  size_t curTokenStart;
+// names of each command's integer args, in Int_arg order
+static const char* request_int_arg_names[NUM_REQUEST_CMDS][MAX_INT_ARGS] = {
+  {},
+  {"x"},
+  {"n"},
+  {"n1", "n2", "n3", "n4"},
+  {"x"},
+  {"x"},
+  {},
+  {"lo", "hi"},
+  {"x"}
 };
 
-/*
- * StringTokenizer constructor --
- *
- * Initializes tokenizer with source string 'str'. Valid token
- * delimiters are characters in the 'delimit'.
- */
-StringTokenizer::StringTokenizer(const std::string& str,
-                                 const std::string& delimit) {
-  sourceStr = str;
-  delimiters = delimit;
-  Reset();
+// FNV-1a, usable in constant expressions
+static constexpr uint32_t name_hash(const char* s, size_t len,
+                                    uint32_t h = 2166136261u) {
+  return len == 0 ? h :
+    name_hash(s + 1, len - 1, (h ^ (uint8_t)s[0]) * 16777619u);
 }
 
-/*
- * Reset --
- *
- * Resets the tokenizer.  Next call to NextToken() will return the
- * first token.
- */
-void
-StringTokenizer::Reset() {
-  curTokenStart = sourceStr.find_first_not_of(delimiters, 0);
+template <size_t N>
+static constexpr uint32_t literal_hash(const char (&s)[N]) {
+  return name_hash(s, N - 1);
 }
 
 /*
- * NoMoreTokens --
+ * parse_request_cmd --
  *
- * Returns true if there are no more tokens in the string.  False
- * otherwise.
+ * Every request is parsed once as it comes in.  Rather than comparing
+ * the name against each command in turn it is hashed and switched on;
+ * the case labels are hashed by the compiler, which also rejects the
+ * table if two names collide.  One compare then rules out an unknown
+ * name that happens to share a hash.
  */
-bool
-StringTokenizer::NoMoreTokens() const {
-  return (curTokenStart == std::string::npos);
+Request_cmd parse_request_cmd(const char* name, size_t len) {
+  Request_cmd cmd;
+  switch (name_hash(name, len)) {
+  case literal_hash("418wisdom"):        cmd = CMD_418WISDOM; break;
+  case literal_hash("countprimes"):      cmd = CMD_COUNTPRIMES; break;
+  case literal_hash("compareprimes"):    cmd = CMD_COMPAREPRIMES; break;
+  case literal_hash("projectidea"):      cmd = CMD_PROJECTIDEA; break;
+  case literal_hash("tellmenow"):        cmd = CMD_TELLMENOW; break;
+  case literal_hash("lastrequest"):      cmd = CMD_LASTREQUEST; break;
+  case literal_hash("countprimesrange"): cmd = CMD_COUNTPRIMESRANGE; break;
+  case literal_hash("bandwidth"):        cmd = CMD_BANDWIDTH; break;
+  default:
+    return CMD_OTHER;
+  }
+  const char* expected = request_cmd_names[cmd];
+  if (strlen(expected) != len || memcmp(expected, name, len) != 0)
+    return CMD_OTHER;
+  return cmd;
+}
+
+Request_cmd parse_request_cmd(const std::string& name) {
+  return parse_request_cmd(name.data(), name.size());
+}
+
+const char* request_cmd_name(Request_cmd cmd) {
+  if (cmd <= CMD_OTHER || cmd >= NUM_REQUEST_CMDS)
+    return "";
+  return request_cmd_names[cmd];
+}
+
+
+Request_msg::Request_msg() {
+  f.tag = 0;
+  f.cmd = CMD_OTHER;
+  memset(f.int_args, 0, sizeof(f.int_args));
+  f.num_args = 0;
+  f.text_len = 0;
+  f.inline_text[0] = '\0';
+  heap_text = NULL;
+}
+
+Request_msg::Request_msg(int argTag) : Request_msg() {
+  f.tag = argTag;
 }
 
 /*
- * NextToken --
+ * Request_msg --
  *
- * Returns the next token in the string.  The current implementation
- * skips over empty tokens (adjacent delimiter characters in the
- * string will not cause NextToken to return an empty string as a
- * valid token).
+ * Parses "key=value;key=value...".  Whitespace around keys and values
+ * is dropped, pairs without a key, a value or an '=' are skipped, and
+ * a repeated key keeps its last value.  New keys past the first
+ * REQUEST_MAX_ARGS are dropped.
  */
-std::string
-StringTokenizer::NextToken() {
-  size_t tokenStart = curTokenStart;
-  size_t tokenEnd = sourceStr.find_first_of(delimiters, curTokenStart);
+Request_msg::Request_msg(int argTag, const std::string& str) : Request_msg() {
+  f.tag = argTag;
+  Arg_view keys[REQUEST_MAX_ARGS];
+  Arg_view values[REQUEST_MAX_ARGS];
+  int n = 0;
 
-  curTokenStart = sourceStr.find_first_not_of(delimiters, tokenEnd);
-
-  if (tokenStart == std::string::npos)
-    return "";
-  else if (tokenEnd == std::string::npos)
-    return sourceStr.substr(tokenStart);
-  else
-    return sourceStr.substr(tokenStart, tokenEnd - tokenStart);
+  const char* p = str.data();
+  const char* end = p + str.size();
+  while (p < end) {
+    const char* token_end = static_cast<const char*>(memchr(p, ';', end - p));
+    if (token_end == NULL)
+      token_end = end;
+    const char* eq = static_cast<const char*>(memchr(p, '=', token_end - p));
+    if (eq != NULL && eq != p && eq + 1 != token_end) {
+      Arg_view key = trim(p, eq);
+      if (!key.empty()) {
+        int added = put_arg(keys, values, n, key, trim(eq + 1, token_end));
+        n = (added < 0) ? n : added;
+      }
+    }
+    p = token_end + 1;
+  }
+  set_args(keys, values, n);
 }
 
+Request_msg::Request_msg(int argTag, const Arg_view* keys,
+                         const Arg_view* values, int num) : Request_msg() {
+  f.tag = argTag;
+  Arg_view unique_keys[REQUEST_MAX_ARGS];
+  Arg_view unique_values[REQUEST_MAX_ARGS];
+  int n = 0;
+  for (int i = 0; i < num && n >= 0; i++)
+    n = put_arg(unique_keys, unique_values, n, keys[i], values[i]);
+  if (n < 0)
+    abort();
+  set_args(unique_keys, unique_values, n);
+}
 
-Request_msg::Request_msg(int argTag) {
-  tag = argTag;
+Request_msg::Request_msg(int arg_tag, const Request_msg& r) : Request_msg(r) {
+  f.tag = arg_tag;
 }
 
-Request_msg::Request_msg(int argTag, const std::string& str) {
-  tag = argTag;
-  StringTokenizer tok(str, ";");
-  while (!tok.NoMoreTokens()) {
-    std::string str = tok.NextToken();
-    std::string key;
-    std::string value;
-    ParseKeyValue(key, value, str);
-    if (key.size() != 0)
-      dict[key] = value;
+Request_msg::Request_msg(const Request_msg& r) {
+  f = r.f;
+  heap_text = NULL;
+  if (r.heap_text) {
+    heap_text = static_cast<char*>(malloc(f.text_len + 1));
+    memcpy(heap_text, r.heap_text, f.text_len + 1);
   }
 }
 
+Request_msg::Request_msg(Request_msg&& r) {
+  f = r.f;
+  heap_text = r.heap_text;
+  r.heap_text = NULL;
+  r.f.num_args = 0;
+  r.f.text_len = 0;
+}
 
-Request_msg::Request_msg(int arg_tag, const Request_msg& r) {
-  tag = arg_tag;
-  dict = r.dict;
+Request_msg::~Request_msg() {
+  free(heap_text);
 }
 
-Request_msg::Request_msg(const Request_msg& r) {
-  tag = r.tag;
-  dict = r.dict;
+Request_msg& Request_msg::operator=(const Request_msg& r) {
+  if (this != &r) {
+    Request_msg copy(r);
+    *this = std::move(copy);
+  }
+  return *this;
 }
 
-void Request_msg::set_arg(const std::string& key, const std::string& value) {
-  dict[key] = value;
+Request_msg& Request_msg::operator=(Request_msg&& r) {
+  if (this != &r) {
+    free(heap_text);
+    f = r.f;
+    heap_text = r.heap_text;
+    r.heap_text = NULL;
+    r.f.num_args = 0;
+    r.f.text_len = 0;
+  }
+  return *this;
 }
 
-std::string Request_msg::get_arg(const std::string& name) const {
-  std::map<std::string, std::string>::const_iterator it = dict.find(name);
-  if (it == dict.end())
-    return "";
-  else
-    return it->second;
+// Index of the arg called 'name', or -1.
+int Request_msg::find_arg(const char* name, size_t len) const {
+  Arg_view key(name, len);
+  for (int i = 0; i < f.num_args; i++) {
+    if (same_text(arg_key(i), key))
+      return i;
+  }
+  return -1;
 }
 
-std::string Request_msg::get_request_string() const {
+/*
+ * set_args --
+ *
+ * Replaces the args with the n given pairs (distinct keys, in any
+ * order).  They may point into this request's own text: the new text
+ * is written elsewhere before it replaces the old.
+ */
+void Request_msg::set_args(const Arg_view* keys, const Arg_view* values, int n) {
+  int order[REQUEST_MAX_ARGS];
+  for (int i = 0; i < n; i++) {
+    order[i] = i;
+    for (int j = i; j > 0 && key_less(keys[order[j]], keys[order[j - 1]]); j--) {
+      int tmp = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = tmp;
+    }
+  }
+
+  size_t len = 0;
+  for (int i = 0; i < n; i++)
+    len += (i ? 1 : 0) + keys[i].size() + 1 + values[i].size();
+
+  // nul terminated, so atoi can read the last value in place
+  char stack_text[REQUEST_INLINE_BYTES];
+  bool fits = (len + 1 <= REQUEST_INLINE_BYTES);
+  char* out = fits ? stack_text : static_cast<char*>(malloc(len + 1));
+  size_t pos = 0;
+  for (int i = 0; i < n; i++) {
+    const Arg_view& key = keys[order[i]];
+    const Arg_view& value = values[order[i]];
+    if (i)
+      out[pos++] = ';';
+    f.key_off[i] = pos;
+    f.key_len[i] = key.size();
+    memcpy(out + pos, key.data(), key.size());
+    pos += key.size();
+    out[pos++] = '=';
+    f.value_off[i] = pos;
+    f.value_len[i] = value.size();
+    memcpy(out + pos, value.data(), value.size());
+    pos += value.size();
+  }
+  out[pos] = '\0';
+
+  free(heap_text);
+  heap_text = NULL;
+  if (fits)
+    memcpy(f.inline_text, stack_text, len + 1);
+  else
+    heap_text = out;
+  f.num_args = n;
+  f.text_len = len;
+  decode_int_args();
+}
 
-  // serialize dict
+// Decodes the command and its integer args from the text.
+void Request_msg::decode_int_args() {
+  int c = find_arg("cmd", 3);
+  f.cmd = CMD_OTHER;
+  if (c >= 0) {
+    Arg_view name = arg_value(c);
+    f.cmd = parse_request_cmd(name.data(), name.size());
+  }
+  for (int i = 0; i < MAX_INT_ARGS; i++) {
+    const char* name = request_int_arg_names[f.cmd][i];
+    int a = name ? find_arg(name, strlen(name)) : -1;
+    // a value ends at a ';' or the terminating nul, either of which
+    // stops atoi
+    f.int_args[i] = (a >= 0) ? atoi(text() + f.value_off[a]) : 0;
+  }
+}
 
-  bool first = true;
-  std::ostringstream oss;
-  for (std::map<std::string, std::string>::const_iterator it = dict.begin(); it != dict.end(); it++) {
-    if (!first)
-      oss << ";";
-    oss << it->first << "=" << it->second;
-    first = false;
+void Request_msg::set_arg(const std::string& key, const std::string& value) {
+  Arg_view keys[REQUEST_MAX_ARGS];
+  Arg_view values[REQUEST_MAX_ARGS];
+  int n = f.num_args;
+  for (int i = 0; i < n; i++) {
+    keys[i] = arg_key(i);
+    values[i] = arg_value(i);
   }
+  n = put_arg(keys, values, n, Arg_view(key.data(), key.size()),
+              Arg_view(value.data(), value.size()));
+  if (n < 0)
+    abort();
+  set_args(keys, values, n);
+}
 
-  return oss.str();
+Arg_view Request_msg::get_arg(const char* name) const {
+  int i = find_arg(name, strlen(name));
+  if (i < 0)
+    return Arg_view();
+  return arg_value(i);
 }
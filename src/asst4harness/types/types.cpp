@@ -40,6 +40,24 @@ std::ostream& operator<< (std::ostream &out, const message_t &message) {
     case WORKER_UP_TIME_STATS:
       out << "WORKER_UP_TIME_STATS";
       break;
+    case HELLO:
+      out << "HELLO";
+      break;
+    case SLOTS:
+      out << "SLOTS";
+      break;
+    case CANCEL:
+      out << "CANCEL";
+      break;
+    case DRAIN:
+      out << "DRAIN";
+      break;
+    case RETURNED:
+      out << "RETURNED";
+      break;
+    case DRAINED:
+      out << "DRAINED";
+      break;
     default:
       LOG(FATAL) << "Invalid message " << std::hex << static_cast<int>(message);
   }
@@ -51,3 +69,27 @@ std::ostream& operator<< (std::ostream &out, const worker_stats_t &stats) {
              << ", memory_threads=" << stats.memory_threads
              << ", io_threads=" << stats.io_threads << ")";
 }
+
+std::ostream& operator<< (std::ostream &out, const worker_info_t &info) {
+  return out << "Info(contexts=" << info.num_contexts
+             << ", llc_domains=" << info.num_llc_domains << ")";
+}
+
+std::ostream& operator<< (std::ostream &out, const worker_slots_t &slots) {
+  return out << "Slots(cpu=" << slots.cpu_slots
+             << ", cache=" << slots.cache_slots
+             << ", light=" << slots.light_slots << ")";
+}
+
+std::ostream& operator<< (std::ostream &out, const wire_frame_t &frame) {
+  out << "Frame(v" << (frame.header.version & ~WIRE_FRAME_BIT)
+      << ", " << static_cast<message_t>(frame.header.message)
+      << ", command=" << static_cast<int>(frame.header.command)
+      << ", tag=" << frame.header.tag << ", args=[";
+  for (size_t i = 0; i < frame.args.size(); i++) {
+    if (i > 0)
+      out << ",";
+    out << std::string(frame.args[i].data, frame.args[i].len);
+  }
+  return out << "])";
+}
@@ -4,8 +4,10 @@
 #define TYPES_H_
 
 #include <boost/shared_ptr.hpp>
+#include <stdint.h>
 
 #include <iostream>
+#include <vector>
 
 typedef enum {
   WORK,
@@ -15,7 +17,13 @@ typedef enum {
   STATS,
   ISREADY,
   SHUTDOWN,
-  WORKER_UP_TIME_STATS
+  WORKER_UP_TIME_STATS,
+  HELLO,
+  SLOTS,
+  CANCEL,
+  DRAIN,
+  RETURNED,
+  DRAINED
 } message_t;
 
 typedef struct {
@@ -29,6 +37,25 @@ typedef struct {
   int io_threads;
 } worker_stats_t;
 
+// What a versioned worker says about itself in its HELLO frame (see
+// frame_to_hello), ahead of its NEW_WORKER; 0 for whatever it didn't
+// say.  num_contexts is the hardware threads (execution contexts) it
+// runs on, i.e. how many requests it can make progress on at once;
+// num_llc_domains the last-level caches those share, one projectidea
+// running in each.
+typedef struct {
+  int num_contexts;
+  int num_llc_domains;
+} worker_info_t;
+
+// Sent by a worker in pull mode: how many more requests of each
+// resource class it will take on top of those it was already given.
+typedef struct {
+  int cpu_slots;    // general pool threads
+  int cache_slots;  // the L3-sized (projectidea) slot
+  int light_slots;  // the tellmenow lane
+} worker_slots_t;
+
 typedef struct {
   int buf_len;
   boost::shared_ptr<char[]> buf;
@@ -39,9 +66,43 @@ typedef struct {
   boost::shared_ptr<char[]> buf;
 } resp_t;
 
+// Binary framing between the master and workers (see comm.cpp).  The
+// first byte of a frame has WIRE_FRAME_BIT set, which the first byte
+// of a tagged_message_t (a small message_t, little endian) never has,
+// so a reader can tell the two apart by peeking one byte.
+#define WIRE_VERSION 1
+#define WIRE_FRAME_BIT 0x80
+#define WIRE_MAX_BODY (16 * 1024 * 1024)
+#define WIRE_MAX_ARGS 255
+
+typedef struct {
+  uint8_t version;    // WIRE_FRAME_BIT | version of the sender
+  uint8_t message;    // message_t
+  uint8_t command;    // Request_cmd of a WORK frame, otherwise 0
+  uint8_t argc;       // number of args in the body
+  int32_t tag;
+  uint32_t body_len;  // each arg is a uint32_t length and its bytes
+} wire_header_t;
+
+// An arg of a frame, pointing at bytes owned by someone else.
+typedef struct {
+  const char* data;
+  uint32_t len;
+} wire_arg_t;
+
+// A received frame.  The args point into the Channel's read buffer
+// (see channel_msg_t).
+typedef struct {
+  wire_header_t header;
+  std::vector<wire_arg_t> args;
+} wire_frame_t;
+
 std::ostream& operator<< (std::ostream &out, const work_t& work);
 std::ostream& operator<< (std::ostream &out, const resp_t& resp);
 std::ostream& operator<< (std::ostream &out, const message_t& work);
 std::ostream& operator<< (std::ostream &out, const worker_stats_t& stats);
+std::ostream& operator<< (std::ostream &out, const worker_info_t& info);
+std::ostream& operator<< (std::ostream &out, const worker_slots_t& slots);
+std::ostream& operator<< (std::ostream &out, const wire_frame_t& frame);
 
 #endif  // TYPES_H_
@@ -8,19 +8,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
-#include <boost/make_shared.hpp>
 
 #include <string>
 
+#include "comm/channel.h"
 #include "comm/connect.h"
 #include "comm/comm.h"
 #include "server/messages.h"
 #include "server/worker.h"
 
 extern void init_work_engine();
+static void worker_end_drain();
 
 
 static int master_fd = -1;
+// buffered connection to the master.  Its read side belongs to the
+// main loop, its write side is protected by master_write_lock.
+static Channel* master_channel = NULL;
+// framing version agreed with the master, 0 for the legacy messages
+static int wire_version = 0;
 DEFINE_int32(cpu_threads, 2, "Number of threads to use");
 DEFINE_int32(memory_threads, 2, "Number of threads to use");
 DEFINE_int32(io_threads, 2, "Number of threads to use");
@@ -37,6 +43,8 @@ DEFINE_string(assets_dir, "./data", "Assets directory");
 
 // You should probably hold onto this when writing to master_fd.
 pthread_mutex_t master_write_lock = PTHREAD_MUTEX_INITIALIZER;
+// set while some thread is sending master_channel's pending writes
+static bool master_flush_active = false;
 
 // seconds
 const int WORKER_BOOT_LATENCY = 1;
@@ -55,47 +63,79 @@ void harness_boot_worker(bool fastBoot) {
   init_work_engine();
 }
 
-void harness_connect_to_master(const std::string& port, int tag) {
+/*
+ * harness_connect_to_master --
+ *
+ * Registers with the master with a NEW_WORKER message carrying the
+ * launch tag.  NEW_WORKER stays a bare tagged message, which masters
+ * of every version read; a versioned worker sends a HELLO frame
+ * first, with what it runs on, so the master knows that by the time
+ * it handles the NEW_WORKER.
+ */
+void harness_connect_to_master(const std::string& port, int tag,
+                               const Worker_resources& resources) {
 
   master_fd = connect_to(port.c_str());
   CHECK_GE(master_fd, 0) << "Worker could not connect to master" << port;
   DLOG(INFO) << "Connected to master " << port;
 
-  CHECK_GE(send_message(master_fd, NEW_WORKER, tag), 0)
+  master_channel = new Channel(master_fd);
+
+  // the master only sends frames to workers it has received one from
+  if (wire_version > 0) {
+    worker_info_t info;
+    info.num_contexts = resources.num_contexts;
+    info.num_llc_domains = resources.num_llc_domains;
+    master_channel->put_hello_frame(tag, info);
+  }
+  master_channel->put_message(NEW_WORKER, tag);
+  CHECK_GE(master_channel->flush(), 0)
     << "Couldn't register with master";
 
 }
 
 void harness_begin_main_loop() {
 
-  work_t work;
-  int tag;
-  message_t message;
-  while (recv_message(master_fd, &message, &tag) == 0) {
-    if (message == REQUEST_STATS) {
-      //  DLOG_IF(INFO, FLAGS_log_network) << "Master requested stats";
-      //  CHECK_GE(send_stats(master_fd), 0) << "Error sending to master";
-      continue;
+  channel_msg_t msg;
+  int ret;
+  while (master_channel->fill() == 0) {
+    while ((ret = master_channel->next(&msg)) > 0) {
+      if (!msg.framed && msg.message == REQUEST_STATS) {
+        //  DLOG_IF(INFO, FLAGS_log_network) << "Master requested stats";
+        //  CHECK_GE(send_stats(master_fd), 0) << "Error sending to master";
+        continue;
+      }
+      if (!msg.framed && msg.message == CANCEL) {
+        DLOG_IF(INFO, FLAGS_log_network) << "Master cancelled " << msg.tag;
+        // student code
+        worker_handle_cancel(msg.tag);
+        continue;
+      }
+      if (!msg.framed && msg.message == DRAIN) {
+        DLOG_IF(INFO, FLAGS_log_network) << "Master is draining this worker";
+        // student code
+        worker_handle_drain();
+        worker_end_drain();
+        continue;
+      }
+      CHECK_EQ(msg.message, WORK) << "Invalid message type " << msg.message;
+
+      Request_msg req;
+      if (msg.framed) {
+        DLOG_IF(INFO, FLAGS_log_network) << "Got " << msg.frame << " from master";
+        CHECK_GE(frame_to_request(msg.frame, &req), 0)
+          << "Malformed frame " << msg.frame;
+      } else {
+        DLOG_IF(INFO, FLAGS_log_network) << "Got new work (" << msg.tag << ",len="
+                                         << msg.payload_len << ") from master";
+        // convert the payload into a Request_msg to pass to student code
+        req = Request_msg(msg.tag, std::string(msg.payload, msg.payload_len));
+      }
+
+      // student code
+      worker_handle_request(req);
     }
-    CHECK_EQ(message, WORK) << "Invalid message type " << message;
-    CHECK_GE(recv_work(master_fd, &work), 0) << "Error receiving from master";
-
-    DLOG_IF(INFO, FLAGS_log_network) << "Got new work (" << tag << "," << work
-                                     << ") from master";
-
-    // convert a work_t into a Request_msg to pass to student code
-    // Since the content in work_t.buf is not null terminated, this is
-    // a big mess
-    int len = work.buf_len;
-    char* tmp_buffer = new char[len+1];
-    strncpy(tmp_buffer, work.buf.get(), len);
-    tmp_buffer[len] = '\0';
-
-    Request_msg req(tag, tmp_buffer);
-    delete [] tmp_buffer;
-
-    // student code
-    worker_handle_request(req);
+    CHECK_GE(ret, 0) << "Malformed message from master";
   }
 
   char worker_hostname[1024];
@@ -103,28 +143,107 @@ void harness_begin_main_loop() {
   DLOG(INFO) << "Worker on " << worker_hostname << " is shutting down (master terminated connection)" << std::endl;
 }
 
+/*
+ * flush_and_unlock --
+ *
+ * Called with master_write_lock held, after appending to
+ * master_channel.  If no other thread is sending, this one sends the
+ * pending writes, outside the lock, until none are left; messages
+ * that other threads append meanwhile go out with the next send
+ * instead of each costing a syscall of their own.
+ */
+static void flush_and_unlock() {
+
+  if (master_flush_active) {
+    pthread_mutex_unlock(&master_write_lock);
+    return;
+  }
+
+  int err;
+  master_flush_active = true;
+  std::string batch;
+  while (master_channel->has_pending_writes()) {
+    master_channel->take_pending_writes(&batch);
+    pthread_mutex_unlock(&master_write_lock);
+    err = send_all(master_fd, batch.data(), batch.size());
+    CHECK_GE(err, 0) << "Error writing to master!";
+    pthread_mutex_lock(&master_write_lock);
+  }
+  master_flush_active = false;
+  pthread_mutex_unlock(&master_write_lock);
+}
+
+/*
+ * worker_send_response --
+ *
+ * Appends the response to master_channel and sends it, together with
+ * whatever else is pending (see flush_and_unlock).
+ */
 void worker_send_response(const Response_msg& resp) {
 
-  resp_t comm_resp;
   int tag = resp.get_tag();
-  int err;
+  int err = 0;
 
-  // convert student-friendly Response_msg object to the comm layer's
-  // resp_t
-  std::string resp_str = resp.get_response();
-  int allocation_size = resp_str.size();
-  comm_resp.buf = boost::make_shared<char[]>(allocation_size);
-  comm_resp.buf_len = allocation_size;
-  strncpy(comm_resp.buf.get(), resp_str.c_str(), allocation_size);
+  pthread_mutex_lock(&master_write_lock);
+  if (wire_version > 0) {
+    err = master_channel->put_resp_frame(resp);
+  } else {
+    const std::string& resp_str = resp.get_response();
+    master_channel->put_payload(RESPONSE, tag, resp_str.data(), resp_str.size());
+  }
+  CHECK_GE(err, 0) << "Cannot frame response " << tag;
+  DLOG_IF(INFO, FLAGS_log_network) << "(" << tag << "," << resp.get_response()
+                                   << ") to master";
+  flush_and_unlock();
+}
+
+/*
+ * worker_grant_slots --
+ *
+ * Sends a SLOTS message.  It is a legacy tagged message with a fixed
+ * payload whichever framing was negotiated; the master's Channel tells
+ * the two kinds apart by their first byte.
+ */
+void worker_grant_slots(int cpu_slots, int cache_slots, int light_slots) {
+
+  worker_slots_t slots;
+  slots.cpu_slots = cpu_slots;
+  slots.cache_slots = cache_slots;
+  slots.light_slots = light_slots;
 
-  // send the reponse to the master node
-  //DLOG_IF(INFO, FLAGS_log_network) << work << " => " << comm_resp;
   pthread_mutex_lock(&master_write_lock);
-  err = send_resp(master_fd, comm_resp, tag);
-  pthread_mutex_unlock(&master_write_lock);
-  CHECK_GE(err, 0) << "Error writing to master!";
-  DLOG_IF(INFO, FLAGS_log_network) << tag << "," << comm_resp << ") to master";
+  master_channel->put_fixed(SLOTS, 0, &slots, sizeof(slots));
+  DLOG_IF(INFO, FLAGS_log_network) << slots << " to master";
+  flush_and_unlock();
+}
+
+/*
+ * worker_return_request --
+ *
+ * Sends a RETURNED message, a legacy tagged message whichever framing
+ * was negotiated (like SLOTS).
+ */
+void worker_return_request(int tag) {
 
+  pthread_mutex_lock(&master_write_lock);
+  master_channel->put_message(RETURNED, tag);
+  DLOG_IF(INFO, FLAGS_log_network) << "Returned " << tag << " to master";
+  flush_and_unlock();
+}
+
+/*
+ * worker_end_drain --
+ *
+ * Sends a DRAINED message once worker_handle_drain has returned every
+ * request it is going to.  Sent after them, so the master has seen
+ * them all when it gets this.
+ */
+static void worker_end_drain() {
+
+  pthread_mutex_lock(&master_write_lock);
+  master_channel->put_message(DRAINED, 0);
+  DLOG_IF(INFO, FLAGS_log_network) << "Drain done";
+  flush_and_unlock();
 }
 
 int main(int argc, char** argv) {
@@ -151,9 +270,20 @@ int main(int argc, char** argv) {
   Request_msg boot_req(0, FLAGS_workerparams);
 
   //int tag = FLAGS_tag;
-  int tag = atoi(boot_req.get_arg("tag").c_str());
+  int tag = atoi(boot_req.get_arg("tag").str().c_str());
+
+  wire_version = atoi(boot_req.get_arg("wire_version").str().c_str());
+  if (wire_version > WIRE_VERSION) {
+    wire_version = WIRE_VERSION;
+  }
+
+  // student code
+  Worker_resources resources;
+  resources.num_contexts = 0;
+  resources.num_llc_domains = 0;
+  worker_describe_resources(resources);
 
-  harness_connect_to_master(port, tag);
+  harness_connect_to_master(port, tag, resources);
 
   // student code
   worker_node_init( boot_req );
@@ -5,17 +5,44 @@
 #include <glog/logging.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <string>
 #include <fstream>
 #include <map>
+#include <vector>
 
 #include "server/messages.h"
 #include "server/worker.h"
+#include "tools/buffer_pool.h"
 #include "tools/cycle_timer.h"
 
+DEFINE_string(countprimes_engine, "sieve",
+              "Engine for countprimes: 'sieve' (segmented sieve) or 'trial' "
+              "(reference trial division). Both give identical results.");
+DEFINE_int32(job_buffer_cache_mb, 256,
+             "Most memory (MB) the bandwidth and projectidea jobs keep "
+             "mapped between requests for reuse.");
+DEFINE_bool(job_buffer_hugetlb, false,
+            "Take job buffers from the reserved huge page pool "
+            "(MAP_HUGETLB) when it has room, rather than relying on "
+            "transparent huge pages.");
+
+// The sieve keeps one flag byte per odd number.  A segment is sized to
+// stay in the 32 KB L1 data cache of the latedays CPUs.
+#define SIEVE_SEGMENT_ODDS (32 * 1024)
+
+// Long running loops poll their cancel token once every this many
+// iterations (a power of two).  At a few ns per iteration that stops
+// them within a fraction of a millisecond.
+#define CANCEL_CHECK_INTERVAL (64 * 1024)
+
+static inline bool is_cancelled(const Cancel_token* cancel) {
+  return cancel != NULL && cancel->load(std::memory_order_relaxed);
+}
+
 /*
  * high_compute_job --
  *
@@ -23,7 +50,7 @@
  * large number of random numbers).  There is essentially no memory
  * traffic.  The working set is very, very small.
  */
-void high_compute_job(const Request_msg& req, Response_msg& resp) {
+void high_compute_job(int x, Response_msg& resp, const Cancel_token* cancel) {
 
   const char* motivation[16] = {
     "You are going to do a great project",
@@ -45,10 +72,13 @@ void high_compute_job(const Request_msg& req, Response_msg& resp) {
   };
 
   int iters = 175 * 1000 * 1000;
-  unsigned int seed = atoi(req.get_arg("x").c_str());
+  unsigned int seed = x;
 
   for (int i=0; i<iters; i++) {
     seed = rand_r(&seed);
+    if ((i & (CANCEL_CHECK_INTERVAL - 1)) == 0 && is_cancelled(cancel)) {
+      return;
+    }
   }
 
   int idx = seed % 16;
@@ -56,16 +86,14 @@ void high_compute_job(const Request_msg& req, Response_msg& resp) {
 }
 
 /*
- * count_primes_job --
+ * count_primes_trial --
  * 
  * This task has similar workload characteristics as high_compute_job.
  * It is compute intensive, with a tiny working set.  It computes the
  * number of primes up to the input argument N. (We are aware it is
  * not a particularlly intelligent algorithm for doing this.)
  */
-void count_primes_job(const Request_msg& req, Response_msg& resp) {
-
-  int N = atoi(req.get_arg("n").c_str());
+static int count_primes_trial(int N, const Cancel_token* cancel) {
 
   int NUM_ITER = 10;
   int count;
@@ -75,6 +103,10 @@ void count_primes_job(const Request_msg& req, Response_msg& resp) {
 
     for (int i = 3; i < N; i+=2) {    // For every odd number
 
+      if ((i & (2 * CANCEL_CHECK_INTERVAL - 1)) == 1 && is_cancelled(cancel)) {
+        return count;
+      }
+
       int prime;
       int div1, div2, rem;
 
@@ -97,6 +129,131 @@ void count_primes_job(const Request_msg& req, Response_msg& resp) {
     }
   }
 
+  return count;
+}
+
+/*
+ * sieve_base_primes --
+ *
+ * Fills 'primes' with the odd primes p such that p * p < hi.  These
+ * are the only primes needed to sieve any segment below hi.
+ */
+static void sieve_base_primes(int64_t hi, std::vector<int>& primes) {
+  int limit = 1;
+  while ((int64_t)(limit + 1) * (limit + 1) < hi) {
+    limit++;
+  }
+
+  std::vector<char> composite(limit + 1, 0);
+  for (int i = 3; i <= limit; i += 2) {
+    if (composite[i]) {
+      continue;
+    }
+    primes.push_back(i);
+    for (int64_t j = (int64_t)i * i; j <= limit; j += 2 * i) {
+      composite[j] = 1;
+    }
+  }
+}
+
+/*
+ * count_primes_in_range --
+ *
+ * Counts the primes p with lo <= p < hi with a segmented sieve of
+ * Eratosthenes over the odd numbers.  Each segment covers
+ * SIEVE_SEGMENT_ODDS odd numbers so its flags stay in L1 while every
+ * base prime is crossed off.  Only reads shared state, so disjoint
+ * pieces of a range can be counted on different threads.
+ */
+int count_primes_in_range(int lo, int hi) {
+
+  if (lo < 2) {
+    lo = 2;
+  }
+  if (hi <= lo) {
+    return 0;
+  }
+
+  int count = (lo == 2) ? 1 : 0; // the only even prime
+
+  // first odd number >= max(lo, 3)
+  int64_t first = (lo <= 3) ? 3 : (lo | 1);
+  if (first >= hi) {
+    return count;
+  }
+
+  std::vector<int> primes;
+  sieve_base_primes(hi, primes);
+
+  char flags[SIEVE_SEGMENT_ODDS];
+
+  for (int64_t seg_lo = first; seg_lo < hi; seg_lo += 2 * SIEVE_SEGMENT_ODDS) {
+    // flags[k] describes the odd number seg_lo + 2k
+    int64_t num_odds = (hi - seg_lo + 1) / 2;
+    if (num_odds > SIEVE_SEGMENT_ODDS) {
+      num_odds = SIEVE_SEGMENT_ODDS;
+    }
+    int64_t seg_hi = seg_lo + 2 * num_odds;
+    memset(flags, 1, num_odds);
+
+    for (size_t i = 0; i < primes.size(); i++) {
+      int64_t p = primes[i];
+      if (p * p >= seg_hi) {
+        break;
+      }
+      // first odd multiple of p in the segment, but never p itself
+      int64_t start = p * p;
+      if (start < seg_lo) {
+        start = ((seg_lo + p - 1) / p) * p;
+        if ((start & 1) == 0) {
+          start += p;
+        }
+      }
+      for (int64_t k = (start - seg_lo) / 2; k < num_odds; k += p) {
+        flags[k] = 0;
+      }
+    }
+
+    for (int64_t k = 0; k < num_odds; k++) {
+      count += flags[k];
+    }
+  }
+
+  return count;
+}
+
+/*
+ * countprimes_engine_is_sieve --
+ *
+ * True when countprimes requests are computed with
+ * count_primes_in_range instead of trial division.
+ */
+bool countprimes_engine_is_sieve() {
+  return FLAGS_countprimes_engine != "trial";
+}
+
+/*
+ * count_primes_job --
+ *
+ * Computes the number of primes up to the input argument N with the
+ * selected engine.  The trial division loop counts 2 for any N >= 2
+ * plus the odd primes below N, i.e. the primes in [2, max(N, 3)), and
+ * the sieve reproduces exactly that.
+ */
+void count_primes_job(int N, Response_msg& resp, const Cancel_token* cancel) {
+
+  int count;
+
+  if (!countprimes_engine_is_sieve()) {
+    count = count_primes_trial(N, cancel);
+  }
+  else if (N >= 2) {
+    count = count_primes_in_range(2, (N > 3) ? N : 3);
+  }
+  else {
+    count = 0;
+  }
+
   char tmp_buffer[32];
   sprintf(tmp_buffer, "%d", count);
   resp.set_response(tmp_buffer);
@@ -109,9 +266,7 @@ void count_primes_job(const Request_msg& req, Response_msg& resp) {
  * bandwidth requirements since all it does is square the input number
  * and add 10.
  */
-void mini_compute_job(const Request_msg& req, Response_msg& resp) {
-
-  int number = atoi(req.get_arg("x").c_str());
+void mini_compute_job(int number, Response_msg& resp) {
 
   // result = x * x + 10
   int result = number * number + 10;
@@ -139,15 +294,16 @@ const char* responses[10] = {
  * This function streams over a large chunk of memory.  Therefore it
  * is a bandwidth-intensive task.
  */
-void high_bandwidth_job(const Request_msg& req, Response_msg& resp) {
+void high_bandwidth_job(int x, Response_msg& resp, const Cancel_token* cancel) {
 
   const int NUM_ITERS = 100;
   const int ALLOCATION_SIZE = 64 * 1000 * 1000;
   const int NUM_ELEMENTS = ALLOCATION_SIZE / sizeof(unsigned int);
   
   // Allocate a buffer that's much larger than the LLC and populate
-  // it.
-  unsigned int* buffer = new unsigned int[NUM_ELEMENTS];
+  // it.  The buffer comes prefaulted from the thread's pool.
+  unsigned int* buffer = static_cast<unsigned int*>(
+      BufferPool::acquire(NUM_ELEMENTS * sizeof(unsigned int)));
   if (!buffer) {
     // worth checking for
     resp.set_response("allocation failed: worker likely out of memory");
@@ -158,7 +314,7 @@ void high_bandwidth_job(const Request_msg& req, Response_msg& resp) {
     buffer[i] = (unsigned int)i;
   }
   
-  int index = atoi(req.get_arg("x").c_str()) % NUM_ELEMENTS;
+  int index = x % NUM_ELEMENTS;
   unsigned int total = 0;
   
   //double startTime = CycleTimer::currentSeconds();
@@ -166,7 +322,7 @@ void high_bandwidth_job(const Request_msg& req, Response_msg& resp) {
   // loop over the buffer, jumping by a cache line each time.  Simple
   // stride means the prefetcher will probably do reasonably well but
   // we'll be terribly bandwidth bound.
-  for (int iter=0; iter<NUM_ITERS; iter++) {
+  for (int iter=0; iter<NUM_ITERS && !is_cancelled(cancel); iter++) {
     for (int i=0; i<NUM_ELEMENTS; i++) {
       total += buffer[index]; 
       index += 16;
@@ -177,7 +333,7 @@ void high_bandwidth_job(const Request_msg& req, Response_msg& resp) {
   
   //double endTime = CycleTimer::currentSeconds();
 
-  delete [] buffer;
+  BufferPool::release(buffer, NUM_ELEMENTS * sizeof(unsigned int));
   
   //double postFreeTime = CycleTimer::currentSeconds();
 
@@ -202,7 +358,7 @@ void high_bandwidth_job(const Request_msg& req, Response_msg& resp) {
  * bandwidth requirement.  If it falls out of cache, the performance
  * of the code will drop substantially.
  */
-void cachefootprint_job(const Request_msg& req, Response_msg& resp) {
+void cachefootprint_job(int x, Response_msg& resp, const Cancel_token* cancel) {
 
   // hardcode buffer size to about 14 MB (the LLC on latedays CPUs is
   // 15MB)
@@ -210,8 +366,13 @@ void cachefootprint_job(const Request_msg& req, Response_msg& resp) {
   unsigned int n = L3_SIZE / sizeof(void *);
 
   // Make a random permutation of [0 ... n-1].
-  unsigned int seed = atoi(req.get_arg("x").c_str());
-  unsigned int *scratch = new unsigned int[n];
+  unsigned int seed = x;
+  unsigned int *scratch = static_cast<unsigned int*>(
+      BufferPool::acquire(n * sizeof(unsigned int)));
+  if (!scratch) {
+    resp.set_response("allocation failed: worker likely out of memory");
+    return;
+  }
   for (unsigned int i = 0; i < n; i++) {
     scratch[i] = i;
   }
@@ -224,13 +385,18 @@ void cachefootprint_job(const Request_msg& req, Response_msg& resp) {
   }
 
   // Turn the permutation into a cycle of pointers
-  void **arr = new void *[n];
+  void **arr = static_cast<void**>(BufferPool::acquire(n * sizeof(void *)));
+  if (!arr) {
+    BufferPool::release(scratch, n * sizeof(unsigned int));
+    resp.set_response("allocation failed: worker likely out of memory");
+    return;
+  }
   for (unsigned int i = 0; i < n - 1; i++) {
     arr[scratch[i]] = (void *)&arr[scratch[i + 1]];
   }
   arr[scratch[n - 1]] = (void *)&arr[scratch[0]];
   void **p = &arr[scratch[0]];
-  delete scratch;
+  BufferPool::release(scratch, n * sizeof(unsigned int));
 
   //double startTime = CycleTimer::currentSeconds();
 
@@ -243,6 +409,9 @@ void cachefootprint_job(const Request_msg& req, Response_msg& resp) {
   unsigned int nIterations = 100;
   for (unsigned int i = 0; i < nIterations * n; i++) {
     p = (void **)(*p);
+    if ((i & (CANCEL_CHECK_INTERVAL - 1)) == 0 && is_cancelled(cancel)) {
+      break;
+    }
   }
   
   //double endTime = CycleTimer::currentSeconds();
@@ -251,7 +420,7 @@ void cachefootprint_job(const Request_msg& req, Response_msg& resp) {
   //	     << " scan=" << (endTime - startTime) << std::endl;
 
   unsigned int i = p - arr;
-  delete arr;
+  BufferPool::release(arr, n * sizeof(void *));
 
   // now emit a response
 
@@ -286,35 +455,52 @@ void cachefootprint_job(const Request_msg& req, Response_msg& resp) {
  * characteristics of each type of request.
  */ 
 void execute_work(const Request_msg& req, Response_msg& resp) {
+  execute_work(req, resp, NULL);
+}
 
-  std::string cmd = req.get_arg("cmd");
+/*
+ * execute_work --
+ *
+ * As above, but the long running jobs poll 'cancel' and give up as
+ * soon as it is set.  Returns false if the job was cancelled, in which
+ * case 'resp' holds no meaningful answer.
+ */
+bool execute_work(const Request_msg& req, Response_msg& resp,
+                  const Cancel_token* cancel) {
 
-  if (cmd.compare("418wisdom") == 0) {
+  // the command and its args were decoded when the request was built
+  int x = req.get_int_arg(ARG_X);
+  switch (req.get_cmd()) {
+  case CMD_418WISDOM:
     // compute intensive
-    high_compute_job(req, resp);
-  }
-  else if (cmd.compare("countprimes") == 0) {
+    high_compute_job(x, resp, cancel);
+    break;
+  case CMD_COUNTPRIMES:
     // compute intensive
-    count_primes_job(req, resp);
-  }
-  else if (cmd.compare("bandwidth") == 0) {
+    count_primes_job(req.get_int_arg(ARG_N), resp, cancel);
+    break;
+  case CMD_BANDWIDTH:
     // bandwidth intensive
-    high_bandwidth_job(req, resp);
-  }
-  else if (cmd.compare("tellmenow") == 0) {
+    high_bandwidth_job(x, resp, cancel);
+    break;
+  case CMD_TELLMENOW:
     // very little compute or bandwidth (lightweight job)
-    mini_compute_job(req, resp);
-  }
-  else if (cmd.compare("projectidea") == 0) {
+    mini_compute_job(x, resp);
+    break;
+  case CMD_PROJECTIDEA:
     // has an L3-cache sized working set
-    cachefootprint_job(req, resp);
-  }
-  else {
+    cachefootprint_job(x, resp, cancel);
+    break;
+  default:
     resp.set_response("unknown command");
+    break;
   }
+
+  return !is_cancelled(cancel);
 }
 
 
 void init_work_engine() {
-  // no initialize required at this time
+  BufferPool::set_cap((size_t)FLAGS_job_buffer_cache_mb * 1024 * 1024);
+  BufferPool::set_hugetlb(FLAGS_job_buffer_hugetlb);
 }
@@ -3,6 +3,7 @@
 #ifndef __ASST4INCLUDE_MASTER_H__
 #define __ASST4INCLUDE_MASTER_H__
 
+#include <stdint.h>
 
 
 class Response_msg;
@@ -36,6 +37,25 @@ void send_client_response(Client_handle client_handle, const Response_msg& resp)
  */
 void send_request_to_worker(Worker_handle worker_handle, const Request_msg& req);
 
+/**
+ * @brief Tell a worker the request with this tag is no longer needed.
+ *
+ * The worker skips or stops the work if it can, but still sends a
+ * response for the tag (perhaps an empty one), which
+ * handle_worker_response() will be called with as usual.
+ */
+void cancel_worker_request(Worker_handle worker_handle, int tag);
+
+/**
+ * @brief Ask a worker for the requests it has not started yet.
+ *
+ * The worker hands each of them back, and handle_worker_returned()
+ * is called for it instead of handle_worker_response().  Requests
+ * that are already running, and any sent after this, are answered as
+ * usual.  handle_worker_drained() is called once all of them are back.
+ */
+void drain_worker_node(Worker_handle worker_handle);
+
 /**
  * @brief Request a new worker node
  *
@@ -78,16 +98,36 @@ void server_init_complete();
  * @brief Initializes all master node data-structures, etc.
  *
  * @param[out] tick_period call the handle_tick function with every
- * tick_period seconds.
+ * tick_period seconds (it may be a fraction of a second).
  */
-void master_node_init(int max_workers, int& tick_period);
+void master_node_init(int max_workers, double& tick_period);
 
 /**
  * @brief Handle new work from a remote client.
  *
- * This work needs to be serviced, presumably by a worker.
+ * This work needs to be serviced, presumably by a worker.  This and
+ * the handlers below all run on the single dispatcher thread.
+ * fingerprint is the one try_answer_client_request set for req.
+ */
+void handle_client_request(Client_handle client_handle, const Request_msg& req,
+                           uint64_t fingerprint);
+
+/**
+ * @brief Answer a client request without involving the dispatcher.
+ *
+ * Called for every client request before handle_client_request, on
+ * the I/O thread that owns the client's connection.  Calls may run
+ * concurrently with each other and with the other handlers, so only
+ * thread-safe state may be used here.  Return true with resp filled
+ * in to answer the request right away; otherwise the request is
+ * passed on to handle_client_request.
+ *
+ * @param[out] fingerprint passed on with the request to
+ * handle_client_request, so that a hash of the request computed here
+ * needn't be computed again on the dispatcher.
  */
-void handle_client_request(Client_handle client_handle, const Request_msg& req);
+bool try_answer_client_request(const Request_msg& req, Response_msg& resp,
+                               uint64_t& fingerprint);
 
 /**
  * @brief Handle a response from a worker.
@@ -98,13 +138,42 @@ void handle_client_request(Client_handle client_handle, const Request_msg& req);
  */
 void handle_worker_response(Worker_handle worker_handle, const Response_msg& resp);
 
+/**
+ * @brief Handle slots granted by a worker in pull mode.
+ *
+ * The worker will take this many more requests of each resource class
+ * on top of those it was granted before (see worker_grant_slots).
+ */
+void handle_worker_slots(Worker_handle worker_handle, int cpu_slots,
+                         int cache_slots, int light_slots);
+
+/**
+ * @brief Handle a request a draining worker handed back unstarted.
+ *
+ * The request with this tag will get no response from that worker,
+ * so it can be sent elsewhere (see drain_worker_node).
+ */
+void handle_worker_returned(Worker_handle worker_handle, int tag);
+
+/**
+ * @brief Handle the end of a drain.
+ *
+ * Every request the worker handed back for the last drain_worker_node
+ * has been passed to handle_worker_returned by now.
+ */
+void handle_worker_drained(Worker_handle worker_handle);
+
 /**
  * @brief Handle creation of a new worker.
  *
  * When a worker is launched, it is given a tag. When the worker is
- * ready for work, this function is called with the appropriate tag.
+ * ready for work, this function is called with the appropriate tag,
+ * the number of hardware threads the worker runs on and the number of
+ * last-level caches they share (each 0 if the worker didn't say,
+ * e.g. one built before workers advertised it).
  */
-void handle_new_worker_online(Worker_handle worker_handle, int tag);
+void handle_new_worker_online(Worker_handle worker_handle, int tag,
+                              int num_contexts, int num_llc_domains);
 
 /**
  * @brief Handle a timer tick.
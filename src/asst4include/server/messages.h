@@ -1,31 +1,145 @@
 #ifndef __LIBASST4_MESSAGES_H__
 #define __LIBASST4_MESSAGES_H__
 
-#include <map>
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <string>
 
 
+// Commands the server knows about.  Anything else is CMD_OTHER and
+// keeps its name only in the "cmd" arg.  countprimesrange is internal:
+// the master sends it to workers, clients never do.
+enum Request_cmd {
+  CMD_OTHER = 0,
+  CMD_418WISDOM,
+  CMD_COUNTPRIMES,
+  CMD_COMPAREPRIMES,
+  CMD_PROJECTIDEA,
+  CMD_TELLMENOW,
+  CMD_LASTREQUEST,
+  CMD_COUNTPRIMESRANGE,
+  CMD_BANDWIDTH,
+  NUM_REQUEST_CMDS
+};
+
+// Integer args of the commands, decoded when they are set on a
+// Request_msg (see get_int_arg).  Each command numbers its own args
+// from 0.
+enum Int_arg {
+  ARG_X = 0,                     // 418wisdom, projectidea, tellmenow, bandwidth
+  ARG_N = 0,                     // countprimes
+  ARG_N1 = 0, ARG_N2, ARG_N3, ARG_N4,  // compareprimes
+  ARG_LO = 0, ARG_HI,            // countprimesrange
+  MAX_INT_ARGS = 4
+};
+
+Request_cmd parse_request_cmd(const char* name, size_t len);
+Request_cmd parse_request_cmd(const std::string& name);
+const char* request_cmd_name(Request_cmd cmd);
+
+
+// Most args a request can hold, and how many bytes of them (as
+// "key=value;..." text) are kept inside the Request_msg itself.
+// Client requests have at most five short args; longer ones spill to
+// the heap.
+#define REQUEST_MAX_ARGS 8
+#define REQUEST_INLINE_BYTES 128
+
+// A read-only slice of a request's text (an arg key or value).  Valid
+// until the request is changed or destroyed.
+class Arg_view {
+
+  private:
+  const char* ptr;
+  size_t len;
+
+  public:
+  Arg_view() { ptr = ""; len = 0; }
+  Arg_view(const char* arg_ptr, size_t arg_len) { ptr = arg_ptr; len = arg_len; }
+
+  const char* data() const { return ptr; }
+  size_t size() const { return len; }
+  bool empty() const { return len == 0; }
+
+  std::string str() const { return std::string(ptr, len); }
+  operator std::string() const { return str(); }
+
+  bool operator==(const char* s) const {
+    return strncmp(ptr, s, len) == 0 && s[len] == '\0';
+  }
+  bool operator!=(const char* s) const { return !(*this == s); }
+};
+
+std::ostream& operator<<(std::ostream& out, const Arg_view& view);
+
+
+/*
+ * Request_msg --
+ *
+ * The args are kept as the request string itself, "key=value;..."
+ * with the keys sorted, plus the offset and length of every key and
+ * value in it.  Small requests live entirely inside the object, so
+ * copying one is a memcpy and building one allocates nothing.  The
+ * command and its integer args are also decoded as they are set.
+ */
 class Request_msg {
 
   private:
-     std::map<std::string, std::string> dict;
-     std::string request_str;
-     int tag;
+     // everything but the spilled text, so it can be copied as a block
+     struct Fields {
+       int tag;
+       Request_cmd cmd;
+       int int_args[MAX_INT_ARGS];
+       int num_args;
+       uint32_t key_off[REQUEST_MAX_ARGS];
+       uint32_t key_len[REQUEST_MAX_ARGS];
+       uint32_t value_off[REQUEST_MAX_ARGS];
+       uint32_t value_len[REQUEST_MAX_ARGS];
+       uint32_t text_len;
+       char inline_text[REQUEST_INLINE_BYTES];
+     } f;
+     // the text when it doesn't fit in inline_text, else NULL
+     char* heap_text;
+
+     const char* text() const { return heap_text ? heap_text : f.inline_text; }
+     int find_arg(const char* name, size_t len) const;
+     void set_args(const Arg_view* keys, const Arg_view* values, int n);
+     void decode_int_args();
 
   public:
-  Request_msg() { tag=0; }
+  Request_msg();
   Request_msg(int tag);
   Request_msg(int tag, const std::string& str);
+  // from 'num' key/value pairs (at most REQUEST_MAX_ARGS distinct keys)
+  Request_msg(int tag, const Arg_view* keys, const Arg_view* values, int num);
   Request_msg(int tag, const Request_msg& j);
   Request_msg(const Request_msg& j); // copy constructor
+  Request_msg(Request_msg&& j); // move constructor
+  ~Request_msg();
 
-  std::string get_arg(const std::string& name) const;
+  Request_msg& operator=(const Request_msg& j);
+  Request_msg& operator=(Request_msg&& j);
+
+  // The value of arg 'name', empty if there is none.
+  Arg_view get_arg(const char* name) const;
   void set_arg(const std::string& key, const std::string& value);
 
-  void set_tag(int arg_tag) { tag = arg_tag; }
-  int  get_tag() const { return tag; }
+  // The args in key order.
+  int num_args() const { return f.num_args; }
+  Arg_view arg_key(int i) const { return Arg_view(text() + f.key_off[i], f.key_len[i]); }
+  Arg_view arg_value(int i) const { return Arg_view(text() + f.value_off[i], f.value_len[i]); }
 
-  std::string get_request_string() const;
+  // The "cmd" arg, parsed.
+  Request_cmd get_cmd() const { return f.cmd; }
+  // An integer arg of the command (atoi of its string, 0 if missing).
+  int get_int_arg(Int_arg arg) const { return f.int_args[arg]; }
+
+  void set_tag(int arg_tag) { f.tag = arg_tag; }
+  int  get_tag() const { return f.tag; }
+
+  std::string get_request_string() const { return std::string(text(), f.text_len); }
 };
 
 
@@ -34,21 +148,29 @@ class Response_msg {
 private:
   int tag;
   std::string resp_str;
+  // how long the worker spent running the request, not counting the
+  // time it waited in the worker's queues; 0 if not reported
+  double run_seconds;
 
 public:
 
   Response_msg() {
     tag = 0;
+    run_seconds = 0;
   }
 
   Response_msg(int arg_tag) {
     tag = arg_tag;
+    run_seconds = 0;
   }
 
   int  get_tag() const { return tag; }
   void set_tag(int arg_tag) { tag = arg_tag; }
 
-  std::string get_response() const {
+  double get_run_seconds() const { return run_seconds; }
+  void set_run_seconds(double seconds) { run_seconds = seconds; }
+
+  const std::string& get_response() const {
     return resp_str;
   }
 
@@ -1,9 +1,14 @@
 #ifndef __ASST4INCLUDE_WORKER_H__
 #define __ASST4INCLUDE_WORKER_H__
 
+#include <atomic>
+
 class Request_msg;
 class Response_msg;
 
+// Set to ask a running execute_work to stop early.
+typedef std::atomic<bool> Cancel_token;
+
 /**
  ******************************************************************
  * Harness interface available to worker implementation
@@ -16,6 +21,25 @@ class Response_msg;
  */
 void worker_send_response(const Response_msg& resp);
 
+/**
+ * @brief tells the master it may send this many more requests of each
+ * resource class (pull mode)
+ *
+ * Notes: the counts add to whatever the worker granted before; a
+ * master in pull mode only sends work into granted slots.  The
+ * message is ordered with the responses, so granting a slot right
+ * after sending the response that freed it is safe.
+ */
+void worker_grant_slots(int cpu_slots, int cache_slots, int light_slots);
+
+/**
+ * @brief hands a request that was not started back to the master
+ * (after a drain)
+ *
+ * Notes: no response may be sent for the tag afterwards.
+ */
+void worker_return_request(int tag);
+
 /**
  * @brief: perform the work described by 'req', placing a response
  * string in 'resp'
@@ -26,6 +50,35 @@ void worker_send_response(const Response_msg& resp);
  */
 void execute_work(const Request_msg& req, Response_msg& resp);
 
+/**
+ * @brief execute_work that stops early once '*cancel' is set
+ *
+ * Notes: the long running jobs (418wisdom, projectidea, bandwidth and
+ * trial division countprimes) poll the token every few thousand
+ * iterations.  Returns false if the job was cancelled; 'resp' is then
+ * not a valid answer.  'cancel' may be NULL.
+ */
+bool execute_work(const Request_msg& req, Response_msg& resp,
+                  const Cancel_token* cancel);
+
+/**
+ * @brief counts the primes p with lo <= p < hi using the segmented
+ * sieve engine.
+ *
+ * Notes: countprimes with argument n answers
+ * count_primes_in_range(2, max(n, 3)) for n >= 2 and 0 otherwise, so
+ * a countprimes request can be split into disjoint ranges and counted
+ * by several threads at once.
+ */
+int count_primes_in_range(int lo, int hi);
+
+/**
+ * @brief true if countprimes should be answered with
+ * count_primes_in_range (--countprimes_engine=sieve, the default)
+ * rather than by execute_work's reference trial division.
+ */
+bool countprimes_engine_is_sieve();
+
 
 /**
  ******************************************************************
@@ -35,6 +88,20 @@ void execute_work(const Request_msg& req, Response_msg& resp);
  */
 
 
+// What the worker runs on, told to the master when it registers.
+struct Worker_resources {
+  int num_contexts;     // hardware threads its requests run on
+  int num_llc_domains;  // last-level caches those threads share
+};
+
+/**
+ * @brief Describe the node the worker runs on.
+ *
+ * Note: called once, before the worker registers with the master and
+ * before worker_node_init.
+ */
+void worker_describe_resources(Worker_resources& resources);
+
 /**
  * @brief Worker node init hook.
  *
@@ -44,6 +111,26 @@ void execute_work(const Request_msg& req, Response_msg& resp);
 void worker_node_init(const Request_msg& params);
 
 
+/**
+ * @brief Handle a cancel from the master
+ *
+ * Notes: the master no longer needs the response to the request with
+ * this tag.  A response must still be sent for it (it may be empty),
+ * but the work can be skipped, or stopped part way through.  The
+ * cancel may also arrive after the response was sent.
+ */
+void worker_handle_cancel(int tag);
+
+/**
+ * @brief Handle a drain from the master
+ *
+ * Notes: the master is about to retire this worker.  Every request
+ * that has not started running yet should be handed back with
+ * worker_return_request before this returns; the ones already running
+ * finish as usual.
+ */
+void worker_handle_drain();
+
 /**
  * @brief Handle incoming request from master
  *
@@ -0,0 +1,155 @@
+#ifndef __TOOLS_BUFFER_POOL_H__
+#define __TOOLS_BUFFER_POOL_H__
+
+#include <atomic>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define SMALL_PAGE_SIZE 4096
+
+/*
+ * BufferPool --
+ *
+ * Per-thread cache of large scratch buffers, for kernels that need
+ * the same big buffers on every call.  Without it every call pays for
+ * mmap, faulting in (and the kernel zeroing) every page, and munmap.
+ *
+ * Buffers are mapped in whole huge pages and faulted in up front:
+ * from the reserved huge page pool (MAP_HUGETLB) if enabled and it
+ * has room, otherwise as normal pages marked for transparent huge
+ * pages.  release() keeps a buffer for the next acquire() of the same
+ * size on the same thread.  The buffers kept by all threads together
+ * stay under the cap: past it the releasing thread unmaps its own
+ * oldest buffers to make room, and only if that isn't enough (the
+ * other threads hold the rest) the released one itself.  A
+ * buffer is only reused on the NUMA node that faulted it in, so a
+ * thread that moved nodes doesn't stream remote memory.
+ *
+ * Reused buffers hold whatever the last user left in them.
+ */
+class BufferPool {
+public:
+  // Most bytes kept by all threads' caches at once.
+  static void set_cap(size_t bytes) { cap() = bytes; }
+  static void set_hugetlb(bool enabled) { hugetlb() = enabled; }
+
+  // A buffer of at least 'bytes' bytes, or NULL if out of memory.
+  static void* acquire(size_t bytes) {
+    size_t size = round_up(bytes);
+    int node = current_node();
+    std::vector<Buffer>& free_list = local().buffers;
+    for (size_t i = 0; i < free_list.size(); i++) {
+      if (free_list[i].size == size && free_list[i].node == node) {
+        void* mem = free_list[i].mem;
+        free_list.erase(free_list.begin() + i);
+        cached_bytes() -= size;
+        return mem;
+      }
+    }
+    return map(size);
+  }
+
+  // Gives back a buffer from acquire(bytes).
+  static void release(void* mem, size_t bytes) {
+    if (mem == NULL) {
+      return;
+    }
+    size_t size = round_up(bytes);
+    std::vector<Buffer>& free_list = local().buffers;
+    while (cached_bytes().fetch_add(size) + size > cap()) {
+      cached_bytes() -= size;
+      if (free_list.empty()) {
+        munmap(mem, size);
+        return;
+      }
+      // oldest first: the list is kept in release order
+      cached_bytes() -= free_list.front().size;
+      munmap(free_list.front().mem, free_list.front().size);
+      free_list.erase(free_list.begin());
+    }
+    Buffer b;
+    b.mem = mem;
+    b.size = size;
+    b.node = current_node();
+    free_list.push_back(b);
+  }
+
+private:
+  struct Buffer {
+    void* mem;
+    size_t size;
+    int node;
+  };
+
+  // unmaps a thread's buffers when it exits
+  struct Local {
+    std::vector<Buffer> buffers;
+    ~Local() {
+      for (size_t i = 0; i < buffers.size(); i++) {
+        cached_bytes() -= buffers[i].size;
+        munmap(buffers[i].mem, buffers[i].size);
+      }
+    }
+  };
+
+  static Local& local() {
+    static thread_local Local l;
+    return l;
+  }
+
+  static std::atomic<size_t>& cached_bytes() {
+    static std::atomic<size_t> bytes(0);
+    return bytes;
+  }
+
+  static size_t& cap() {
+    static size_t c = 256 * 1024 * 1024;
+    return c;
+  }
+
+  static bool& hugetlb() {
+    static bool enabled = false;
+    return enabled;
+  }
+
+  static size_t round_up(size_t bytes) {
+    return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  }
+
+  static int current_node() {
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+      return -1;
+    }
+    return node;
+  }
+
+  static void* map(size_t size) {
+    if (hugetlb()) {
+      void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                       -1, 0);
+      if (mem != MAP_FAILED) {
+        return mem;
+      }
+    }
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+      return NULL;
+    }
+    // the advice has to come before the first touch to get huge pages
+    madvise(mem, size, MADV_HUGEPAGE);
+    char* p = static_cast<char*>(mem);
+    for (size_t i = 0; i < size; i += SMALL_PAGE_SIZE) {
+      p[i] = 0;
+    }
+    return mem;
+  }
+};
+
+#endif  // __TOOLS_BUFFER_POOL_H__
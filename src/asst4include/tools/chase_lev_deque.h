@@ -0,0 +1,139 @@
+#ifndef __TOOLS_CHASE_LEV_DEQUE_H__
+#define __TOOLS_CHASE_LEV_DEQUE_H__
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+#include "tools/event_count.h"
+
+#define CHASE_LEV_INITIAL_CAPACITY 1024
+
+/*
+ * ChaseLevDeque --
+ *
+ * Work-stealing deque (Chase and Lev, "Dynamic Circular Work-Stealing
+ * Deque", with the C11 memory orderings from Le et al.).  The owning
+ * thread pushes and pops at the bottom; any other thread may steal
+ * from the top.  T has to be trivially copyable since stealers read
+ * slots that the owner may concurrently overwrite; the pool stores
+ * task pointers.
+ *
+ * The ring grows when full.  Old rings are kept until the deque is
+ * destroyed because a stealer may still be reading from them.
+ */
+template <class T>
+class ChaseLevDeque {
+private:
+  struct Ring {
+    int64_t size;
+    std::atomic<T>* slots;
+
+    Ring(int64_t arg_size) : size(arg_size) {
+      slots = new std::atomic<T>[size];
+    }
+    ~Ring() { delete [] slots; }
+
+    T get(int64_t i) const {
+      return slots[i & (size - 1)].load(std::memory_order_relaxed);
+    }
+    void put(int64_t i, T item) {
+      slots[i & (size - 1)].store(item, std::memory_order_relaxed);
+    }
+  };
+
+  alignas(CACHE_LINE_SIZE) std::atomic<int64_t> top;
+  alignas(CACHE_LINE_SIZE) std::atomic<int64_t> bottom;
+  std::atomic<Ring*> ring;
+  std::vector<Ring*> retired; // only touched by the owner
+
+  Ring* grow(Ring* old, int64_t b, int64_t t) {
+    Ring* bigger = new Ring(old->size * 2);
+    for (int64_t i = t; i < b; i++) {
+      bigger->put(i, old->get(i));
+    }
+    retired.push_back(old);
+    ring.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+
+public:
+  ChaseLevDeque() : top(0), bottom(0) {
+    ring.store(new Ring(CHASE_LEV_INITIAL_CAPACITY), std::memory_order_relaxed);
+  }
+
+  ~ChaseLevDeque() {
+    delete ring.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < retired.size(); i++) {
+      delete retired[i];
+    }
+  }
+
+  ChaseLevDeque(const ChaseLevDeque&) = delete;
+  ChaseLevDeque& operator=(const ChaseLevDeque&) = delete;
+
+  // Owner only.
+  void push(T item) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Ring* r = ring.load(std::memory_order_relaxed);
+    if (b - t > r->size - 1) {
+      r = grow(r, b, t);
+    }
+    r->put(b, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+
+  // Owner only.  Returns false if the deque is empty.
+  bool pop(T& item) {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Ring* r = ring.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+      // empty
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+
+    item = r->get(b);
+    if (t == b) {
+      // last item: race the stealers for it
+      bool won = top.compare_exchange_strong(t, t + 1,
+                                             std::memory_order_seq_cst,
+                                             std::memory_order_relaxed);
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  // Any thread.  Returns false if the deque was empty or another
+  // thread won the race for the top item.
+  bool steal(T& item) {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+      return false;
+    }
+
+    Ring* r = ring.load(std::memory_order_acquire);
+    item = r->get(t);
+    return top.compare_exchange_strong(t, t + 1,
+                                       std::memory_order_seq_cst,
+                                       std::memory_order_relaxed);
+  }
+
+  // Snapshot of the number of items; may be stale.
+  int64_t size() const {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_relaxed);
+    return (b > t) ? b - t : 0;
+  }
+};
+
+#endif  // __TOOLS_CHASE_LEV_DEQUE_H__
@@ -0,0 +1,80 @@
+#ifndef __TOOLS_EVENT_COUNT_H__
+#define __TOOLS_EVENT_COUNT_H__
+
+#include <atomic>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define CACHE_LINE_SIZE 64
+
+/*
+ * EventCount --
+ *
+ * Lets threads block on a condition that is checked without holding a
+ * lock (e.g. "a lock-free queue is non-empty").  A waiter does
+ *
+ *   uint32_t key = ec.prepare_wait();
+ *   if (condition holds) ec.cancel_wait(); else ec.wait(key);
+ *
+ * and the thread that makes the condition true calls notify_one() or
+ * notify_all() afterwards.  Notifying is a single load when nobody is
+ * waiting, so the fast path of the data structure stays syscall free.
+ * Sleeping is done with a private futex on the epoch word.
+ */
+class EventCount {
+private:
+  std::atomic<uint32_t> epoch;
+  std::atomic<int> waiters;
+
+  void futex_wait(uint32_t key) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch),
+            FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+  }
+
+  void futex_wake(int count) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch),
+            FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+  }
+
+  void notify(int count) {
+    // pairs with the fence in prepare_wait: either we see the waiter,
+    // or the waiter sees whatever we published before notifying
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    epoch.fetch_add(1, std::memory_order_release);
+    futex_wake(count);
+  }
+
+public:
+  EventCount() : epoch(0), waiters(0) {}
+
+  EventCount(const EventCount&) = delete;
+  EventCount& operator=(const EventCount&) = delete;
+
+  uint32_t prepare_wait() {
+    waiters.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return epoch.load(std::memory_order_acquire);
+  }
+
+  void cancel_wait() {
+    waiters.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  void wait(uint32_t key) {
+    while (epoch.load(std::memory_order_acquire) == key) {
+      futex_wait(key);
+    }
+    waiters.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  void notify_one() { notify(1); }
+  void notify_all() { notify(INT_MAX); }
+};
+
+#endif  // __TOOLS_EVENT_COUNT_H__
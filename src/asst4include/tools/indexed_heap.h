@@ -0,0 +1,137 @@
+#ifndef __TOOLS_INDEXED_HEAP_H__
+#define __TOOLS_INDEXED_HEAP_H__
+
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+/*
+ * IndexedHeap --
+ *
+ * Binary min-heap of small integer ids, each with a key.  It also
+ * records where each id sits in the heap, so the key of an id that is
+ * already in it can be changed, or the id removed, in O(log n); top()
+ * is O(1).  Ids index a vector, so they should be dense (e.g. slots of
+ * a table).
+ *
+ * Not thread safe.
+ */
+template <class Key>
+class IndexedHeap {
+public:
+  bool empty() const { return heap.empty(); }
+  size_t size() const { return heap.size(); }
+
+  bool contains(int id) const {
+    return id >= 0 && (size_t)id < position.size() && position[id] != NOT_IN_HEAP;
+  }
+
+  // The id with the smallest key.  The heap must not be empty.
+  int top() const { return heap[0].second; }
+
+  // The id with the smallest key other than 'id', or -1 if there is
+  // none.  The runner-up of a heap is always a child of its root.
+  int top_excluding(int id) const {
+    if (heap.empty()) {
+      return -1;
+    }
+    if (heap[0].second != id) {
+      return heap[0].second;
+    }
+    if (heap.size() == 1) {
+      return -1;
+    }
+    if (heap.size() == 2 || heap[1].first < heap[2].first) {
+      return heap[1].second;
+    }
+    return heap[2].second;
+  }
+
+  // Inserts 'id', or changes its key if it is already in the heap.
+  void set(int id, const Key& key) {
+    if ((size_t)id >= position.size()) {
+      position.resize(id + 1, NOT_IN_HEAP);
+    }
+    size_t i = position[id];
+    if (i == NOT_IN_HEAP) {
+      heap.push_back(std::make_pair(key, id));
+      position[id] = heap.size() - 1;
+      sift_up(heap.size() - 1);
+      return;
+    }
+    Key old = heap[i].first;
+    heap[i].first = key;
+    if (key < old) {
+      sift_up(i);
+    } else {
+      sift_down(i);
+    }
+  }
+
+  // Removes 'id' if it is in the heap.
+  void remove(int id) {
+    if (!contains(id)) {
+      return;
+    }
+    size_t i = position[id];
+    position[id] = NOT_IN_HEAP;
+    if (i == heap.size() - 1) {
+      heap.pop_back();
+      return;
+    }
+    // the last entry fills the hole, and may need to move either way
+    int moved = heap.back().second;
+    heap[i] = heap.back();
+    heap.pop_back();
+    position[moved] = i;
+    sift_up(i);
+    sift_down(position[moved]);
+  }
+
+private:
+  static const size_t NOT_IN_HEAP = (size_t)-1;
+
+  std::vector<std::pair<Key, int> > heap;
+  std::vector<size_t> position;  // of each id in 'heap'
+
+  void swap_entries(size_t a, size_t b) {
+    std::swap(heap[a], heap[b]);
+    position[heap[a].second] = a;
+    position[heap[b].second] = b;
+  }
+
+  void sift_up(size_t i) {
+    while (i > 0) {
+      size_t parent = (i - 1) / 2;
+      if (!(heap[i].first < heap[parent].first)) {
+        break;
+      }
+      swap_entries(i, parent);
+      i = parent;
+    }
+  }
+
+  void sift_down(size_t i) {
+    while (1) {
+      size_t smallest = i;
+      size_t left = 2 * i + 1;
+      size_t right = left + 1;
+      if (left < heap.size() && heap[left].first < heap[smallest].first) {
+        smallest = left;
+      }
+      if (right < heap.size() && heap[right].first < heap[smallest].first) {
+        smallest = right;
+      }
+      if (smallest == i) {
+        break;
+      }
+      swap_entries(i, smallest);
+      i = smallest;
+    }
+  }
+};
+
+template <class Key>
+const size_t IndexedHeap<Key>::NOT_IN_HEAP;
+
+#endif  // __TOOLS_INDEXED_HEAP_H__
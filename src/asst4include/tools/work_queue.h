@@ -4,42 +4,218 @@
 #define __WORKER_WORK_QUEUE_H__
 
 
+#include <atomic>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <utility>
 #include <vector>
 
+#include "tools/event_count.h"
 
+#define WORK_QUEUE_DEFAULT_CAPACITY 8192
+#define WORK_QUEUE_SPIN_COUNT 64
+
+
+/*
+ * WorkQueue --
+ *
+ * Bounded multi-producer/multi-consumer queue.  Each slot of the ring
+ * carries a sequence number that tells producers and consumers whose
+ * turn it is, so put_work/get_work only need one CAS on the shared
+ * head or tail index and never take a lock.  Slots and indices are
+ * padded to a cache line to keep producers and consumers from false
+ * sharing.  When the queue is empty (or full) callers spin briefly and
+ * then sleep on an EventCount.
+ *
+ * Items are moved in and out of the ring, never copied.
+ */
 template <class T>
 class WorkQueue {
 private:
-  std::vector<T> storage;
-  pthread_mutex_t queue_lock;
-  pthread_cond_t queue_cond;
+  struct alignas(CACHE_LINE_SIZE) Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  Cell* storage;
+  size_t mask;
+
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> enqueue_pos;
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> dequeue_pos;
+
+  EventCount not_empty;
+  EventCount not_full;
+
+  template <class U>
+  bool try_put(U&& item) {
+    Cell* cell;
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    while (1) {
+      cell = &storage[pos & mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+      if (dif == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      }
+      else if (dif < 0) {
+        return false; // full
+      }
+      else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = std::forward<U>(item);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool try_pop(T& item) {
+    Cell* cell;
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    while (1) {
+      cell = &storage[pos & mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (dif == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      }
+      else if (dif < 0) {
+        return false; // empty
+      }
+      else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    item = std::move(cell->data);
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  template <class U>
+  void put_work_impl(U&& item) {
+    for (int i = 0; i < WORK_QUEUE_SPIN_COUNT; i++) {
+      if (try_put(std::forward<U>(item))) {
+        not_empty.notify_one();
+        return;
+      }
+    }
+    while (1) {
+      uint32_t key = not_full.prepare_wait();
+      if (try_put(std::forward<U>(item))) {
+        not_full.cancel_wait();
+        break;
+      }
+      not_full.wait(key);
+    }
+    not_empty.notify_one();
+  }
 
 public:
 
-  WorkQueue() {
-    pthread_cond_init(&queue_cond, NULL);
-    pthread_mutex_init(&queue_lock, NULL);
+  WorkQueue(size_t capacity = WORK_QUEUE_DEFAULT_CAPACITY)
+    : enqueue_pos(0), dequeue_pos(0) {
+    // round the capacity up to a power of two so slots can be
+    // found with a mask
+    size_t size = 2;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask = size - 1;
+
+    void* mem = NULL;
+    if (posix_memalign(&mem, CACHE_LINE_SIZE, size * sizeof(Cell)) != 0) {
+      throw std::bad_alloc();
+    }
+    storage = static_cast<Cell*>(mem);
+    for (size_t i = 0; i < size; i++) {
+      new (&storage[i]) Cell();
+      storage[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  ~WorkQueue() {
+    for (size_t i = 0; i <= mask; i++) {
+      storage[i].~Cell();
+    }
+    free(storage);
   }
 
+  WorkQueue(const WorkQueue&) = delete;
+  WorkQueue& operator=(const WorkQueue&) = delete;
+
+  // Blocks until an item is available.
   T get_work() {
-    pthread_mutex_lock(&queue_lock);
-    while (storage.size() == 0) {
-      pthread_cond_wait(&queue_cond, &queue_lock);
+    T item;
+    for (int i = 0; i < WORK_QUEUE_SPIN_COUNT; i++) {
+      if (try_pop(item)) {
+        not_full.notify_one();
+        return item;
+      }
     }
+    while (1) {
+      uint32_t key = not_empty.prepare_wait();
+      if (try_pop(item)) {
+        not_empty.cancel_wait();
+        break;
+      }
+      not_empty.wait(key);
+    }
+    not_full.notify_one();
+    return item;
+  }
 
-    T item = storage.front();
-    //storage.pop_front();
-    storage.erase(storage.begin());
+  // Returns false immediately if the queue is empty.
+  bool try_get_work(T& item) {
+    if (!try_pop(item)) {
+      return false;
+    }
+    not_full.notify_one();
+    return true;
+  }
 
-    pthread_mutex_unlock(&queue_lock);
-    return item;
+  // Blocks until at least one item is available, then appends up to
+  // max_items items to 'items' without blocking again.  Returns the
+  // number of items appended.
+  size_t get_work_batch(std::vector<T>& items, size_t max_items) {
+    if (max_items == 0) {
+      return 0;
+    }
+    items.push_back(get_work());
+    size_t count = 1;
+    T item;
+    while (count < max_items && try_pop(item)) {
+      items.push_back(std::move(item));
+      count++;
+    }
+    if (count > 1) {
+      not_full.notify_all();
+    }
+    return count;
   }
 
+  // Blocks while the queue is full.
   void put_work(const T& item) {
-    pthread_mutex_lock(&queue_lock);
-    storage.push_back(item);
-    pthread_mutex_unlock(&queue_lock);
-    pthread_cond_signal(&queue_cond);
+    put_work_impl(item);
+  }
+
+  void put_work(T&& item) {
+    put_work_impl(std::move(item));
+  }
+
+  // Number of queued items.  Only a snapshot when other threads are
+  // using the queue.
+  size_t size() const {
+    size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+    size_t head = dequeue_pos.load(std::memory_order_relaxed);
+    return (tail > head) ? tail - head : 0;
   }
 };
 
@@ -0,0 +1,218 @@
+#ifndef __TOOLS_WORK_STEALING_POOL_H__
+#define __TOOLS_WORK_STEALING_POOL_H__
+
+#include <functional>
+#include <new>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "tools/chase_lev_deque.h"
+#include "tools/event_count.h"
+#include "tools/work_queue.h"
+
+#define POOL_STEAL_ATTEMPTS 2
+
+/*
+ * WorkStealingPool --
+ *
+ * A fixed set of threads, each owning a ChaseLevDeque.  Work arrives
+ * three ways:
+ *
+ *  - submit():          from outside the pool (e.g. the thread reading
+ *                       the master socket), through a shared MPMC
+ *                       injection queue.
+ *  - spawn():           from a pool thread, onto its own deque, where
+ *                       idle threads can steal it.  This is how a job
+ *                       splits itself into sub-jobs.
+ *  - submit_priority(): onto the priority lane.  Priority threads only
+ *                       ever serve this lane, and every general thread
+ *                       checks it before anything else, so latency
+ *                       critical work never waits behind a backlog.
+ *
+ * A general thread looks for work in the order: priority lane, own
+ * deque, injection queue, other threads' deques (random victim
+ * first).  Threads with nothing to do sleep on an EventCount.
+ */
+class WorkStealingPool {
+public:
+  typedef std::function<void()> Task_fn;
+
+private:
+  struct Task {
+    Task_fn fn;
+  };
+
+  struct Worker {
+    WorkStealingPool* pool;
+    int index;
+    unsigned int seed;
+    pthread_t thread;
+    ChaseLevDeque<Task*> deque;
+  };
+
+  std::vector<Worker*> workers;
+  std::vector<pthread_t> priority_threads;
+  WorkQueue<Task*> inject_queue;
+  WorkQueue<Task*> priority_queue;
+  EventCount idle;
+
+  static Worker*& current_worker() {
+    static thread_local Worker* worker = NULL;
+    return worker;
+  }
+
+  static void pin_to_cpu(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+  }
+
+  static void run_task(Task* task) {
+    task->fn();
+    delete task;
+  }
+
+  Task* find_task(Worker* self) {
+    Task* task;
+    if (priority_queue.try_get_work(task)) {
+      return task;
+    }
+    if (self->deque.pop(task)) {
+      return task;
+    }
+    if (inject_queue.try_get_work(task)) {
+      return task;
+    }
+
+    int n = workers.size();
+    for (int attempt = 0; attempt < POOL_STEAL_ATTEMPTS; attempt++) {
+      int start = rand_r(&self->seed) % n;
+      for (int i = 0; i < n; i++) {
+        Worker* victim = workers[(start + i) % n];
+        if (victim != self && victim->deque.steal(task)) {
+          return task;
+        }
+      }
+    }
+    return NULL;
+  }
+
+  void worker_loop(Worker* self) {
+    current_worker() = self;
+    while (1) {
+      Task* task = find_task(self);
+      if (task) {
+        run_task(task);
+        continue;
+      }
+
+      uint32_t key = idle.prepare_wait();
+      task = find_task(self);
+      if (task) {
+        idle.cancel_wait();
+        run_task(task);
+        continue;
+      }
+      idle.wait(key);
+    }
+  }
+
+  void priority_loop() {
+    while (1) {
+      run_task(priority_queue.get_work());
+    }
+  }
+
+  static void* worker_start(void* arg) {
+    Worker* self = static_cast<Worker*>(arg);
+    self->pool->worker_loop(self);
+    return NULL;
+  }
+
+  static void* priority_start(void* arg) {
+    static_cast<WorkStealingPool*>(arg)->priority_loop();
+    return NULL;
+  }
+
+public:
+  WorkStealingPool() {}
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+  // Spawns num_threads general threads and num_priority_threads
+  // priority-lane threads.  Thread i (general threads first) is bound
+  // to cpus[i % cpus.size()]; with no cpus the threads aren't pinned.
+  void start(int num_threads, int num_priority_threads,
+             const std::vector<int>& cpus) {
+    for (int i = 0; i < num_threads; i++) {
+      // the deque's indices are cache-line aligned, which plain new
+      // does not honor before C++17
+      void* mem = NULL;
+      if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(Worker)) != 0) {
+        abort();
+      }
+      Worker* w = new (mem) Worker();
+      w->pool = this;
+      w->index = i;
+      w->seed = i + 1;
+      workers.push_back(w);
+    }
+    for (int i = 0; i < num_threads; i++) {
+      pthread_create(&workers[i]->thread, NULL, worker_start, workers[i]);
+      if (!cpus.empty()) {
+        pin_to_cpu(workers[i]->thread, cpus[i % cpus.size()]);
+      }
+    }
+    for (int i = 0; i < num_priority_threads; i++) {
+      pthread_t thread;
+      pthread_create(&thread, NULL, priority_start, this);
+      if (!cpus.empty()) {
+        pin_to_cpu(thread, cpus[(num_threads + i) % cpus.size()]);
+      }
+      priority_threads.push_back(thread);
+    }
+  }
+
+  int num_threads() const { return workers.size(); }
+
+  // Index of the calling general pool thread, or -1 if the caller is
+  // not one.
+  static int current_thread_index() {
+    Worker* w = current_worker();
+    return w ? w->index : -1;
+  }
+
+  void submit(Task_fn fn) {
+    Task* task = new Task();
+    task->fn = std::move(fn);
+    inject_queue.put_work(task);
+    idle.notify_one();
+  }
+
+  void submit_priority(Task_fn fn) {
+    Task* task = new Task();
+    task->fn = std::move(fn);
+    priority_queue.put_work(task);
+    idle.notify_one();
+  }
+
+  // Pushes onto the calling thread's own deque when called from a
+  // general pool thread of this pool, otherwise behaves like submit().
+  void spawn(Task_fn fn) {
+    Worker* w = current_worker();
+    if (w == NULL || w->pool != this) {
+      submit(std::move(fn));
+      return;
+    }
+    Task* task = new Task();
+    task->fn = std::move(fn);
+    w->deque.push(task);
+    idle.notify_one();
+  }
+};
+
+#endif  // __TOOLS_WORK_STEALING_POOL_H__
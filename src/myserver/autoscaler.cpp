@@ -0,0 +1,118 @@
+#include <math.h>
+
+#include "autoscaler.h"
+
+Autoscaler::Autoscaler(double arg_boot_seconds) {
+  for (int c = 0; c < NUM_WORK_CLASSES; c++) {
+    lanes[c] = 1;
+    arrived[c] = 0.0;
+    fast_rate[c] = 0.0;
+    slow_rate[c] = 0.0;
+    forecast[c] = 0.0;
+  }
+  boot_seconds = arg_boot_seconds;
+  last_tick = -1.0;
+  last_change = -1.0;
+  shrinkable_since = -1.0;
+}
+
+void Autoscaler::set_lanes(Work_class cls, int arg_lanes) {
+  lanes[cls] = (arg_lanes > 0) ? arg_lanes : 1;
+}
+
+void Autoscaler::record_arrival(Work_class cls, double estimate) {
+  arrived[cls] += estimate;
+}
+
+void Autoscaler::observe_boot(double seconds) {
+  boot_seconds += AUTOSCALE_BOOT_ALPHA * (seconds - boot_seconds);
+}
+
+// Fraction of the class's capacity on num_workers that serving 'rate'
+// and clearing 'backlog' within 'delay' seconds takes.
+double Autoscaler::utilization(Work_class cls, int num_workers, double rate,
+                               double backlog, double delay) const {
+  if (num_workers <= 0) {
+    return (rate + backlog > 0.0) ? INFINITY : 0.0;
+  }
+  return (rate + backlog / delay) / (num_workers * lanes[cls]);
+}
+
+int Autoscaler::decide(double now, int num_workers, int num_booting,
+                       const double backlog[NUM_WORK_CLASSES]) {
+  if (last_tick < 0.0) {
+    last_tick = now;
+    last_change = now;
+    return (num_workers + num_booting > 0) ? 0 : 1;
+  }
+  double dt = now - last_tick;
+  if (dt <= 0.0) {
+    return 0;
+  }
+  last_tick = now;
+
+  // the averages are taken over time, not over ticks, so the tick
+  // period doesn't change how quickly they react
+  double fast_weight = 1.0 - exp(-dt / AUTOSCALE_FAST_SECONDS);
+  double slow_weight = 1.0 - exp(-dt / AUTOSCALE_SLOW_SECONDS);
+  for (int c = 0; c < NUM_WORK_CLASSES; c++) {
+    double sample = arrived[c] / dt;
+    arrived[c] = 0.0;
+    fast_rate[c] += fast_weight * (sample - fast_rate[c]);
+    slow_rate[c] += slow_weight * (sample - slow_rate[c]);
+    // on a steady ramp each average lags by its time constant times
+    // the slope
+    double slope = (fast_rate[c] - slow_rate[c]) /
+                   (AUTOSCALE_SLOW_SECONDS - AUTOSCALE_FAST_SECONDS);
+    forecast[c] = fast_rate[c] + slope * (AUTOSCALE_FAST_SECONDS + boot_seconds);
+    if (forecast[c] < 0.0) {
+      forecast[c] = 0.0;
+    }
+  }
+
+  int capacity = num_workers + num_booting;
+  bool grow = (capacity == 0);
+  bool shrink = (num_booting == 0 && num_workers > 1);
+  for (int c = 0; c < NUM_WORK_CLASSES; c++) {
+    Work_class cls = (Work_class)c;
+    if (utilization(cls, capacity, forecast[c], backlog[c],
+                    AUTOSCALE_MAX_DELAY) > AUTOSCALE_HIGH_UTILIZATION) {
+      grow = true;
+    }
+    // don't trust a falling forecast to give a worker up
+    double rate = fmax(forecast[c], fast_rate[c]);
+    if (utilization(cls, num_workers - 1, rate, backlog[c],
+                    AUTOSCALE_MAX_DELAY / 2) >= AUTOSCALE_LOW_UTILIZATION) {
+      shrink = false;
+    }
+  }
+
+  if (grow) {
+    shrinkable_since = -1.0;
+    last_change = now;
+    return 1;
+  }
+  if (!shrink) {
+    shrinkable_since = -1.0;
+    return 0;
+  }
+  if (shrinkable_since < 0.0) {
+    shrinkable_since = now;
+  }
+  if (now - shrinkable_since < AUTOSCALE_DOWN_HOLD ||
+      now - last_change < AUTOSCALE_COOLDOWN) {
+    return 0;
+  }
+  shrinkable_since = -1.0;
+  last_change = now;
+  return -1;
+}
+
+std::ostream& operator<< (std::ostream& out, const Autoscaler& scaler) {
+  out << "Autoscaler(boot=" << scaler.boot_seconds << "s";
+  for (int c = 0; c < NUM_WORK_CLASSES; c++) {
+    out << ", " << c << ": rate=" << scaler.fast_rate[c]
+        << " forecast=" << scaler.forecast[c];
+  }
+  return out << ")";
+}
@@ -0,0 +1,85 @@
+#ifndef __MYSERVER_AUTOSCALER_H__
+#define __MYSERVER_AUTOSCALER_H__
+
+#include <iostream>
+
+#include "cost_model.h"
+
+// time constants (seconds) of the fast and slow arrival rate averages
+#define AUTOSCALE_FAST_SECONDS 2.0
+#define AUTOSCALE_SLOW_SECONDS 10.0
+// grow when a class would run above this utilization, shrink only if
+// one worker fewer would stay below the low mark
+#define AUTOSCALE_HIGH_UTILIZATION 0.85
+#define AUTOSCALE_LOW_UTILIZATION 0.5
+// queued and running work should clear within this many seconds
+#define AUTOSCALE_MAX_DELAY 1.0
+// the shrink condition must hold this long, and no change may have
+// been made for this long, before a worker is retired
+#define AUTOSCALE_DOWN_HOLD 3.0
+#define AUTOSCALE_COOLDOWN 4.0
+// weight of the newest observed boot latency
+#define AUTOSCALE_BOOT_ALPHA 0.3
+
+/*
+ * Autoscaler --
+ *
+ * Decides when to add or retire a worker from a forecast of the work
+ * that will be arriving by the time a new worker could be up.
+ *
+ * Work admitted in each class, in estimated seconds of service, is
+ * smoothed into a fast and a slow moving average rate.  During a ramp
+ * the slow one lags further behind, so their gap gives the trend,
+ * which is extrapolated over the boot latency (learned from launches).
+ * A worker serves 'lanes' seconds of a class's work per second, as
+ * last reported by set_lanes (1 until then).
+ *
+ * The fleet grows while some class, at the forecast rate plus the
+ * rate needed to clear its backlog within AUTOSCALE_MAX_DELAY, would
+ * run above the high utilization mark on the workers up or booting.
+ * It shrinks only when one worker fewer would stay below the low mark
+ * while clearing the backlog in half that time, that has held for
+ * AUTOSCALE_DOWN_HOLD, and nothing changed for AUTOSCALE_COOLDOWN.
+ * The marks trade worker-seconds against requests that would wait
+ * past their deadline; the gap between them keeps the fleet from
+ * flapping.
+ *
+ * Only used from the dispatcher, so it does no locking.
+ */
+class Autoscaler {
+public:
+  explicit Autoscaler(double boot_seconds);
+
+  // Workers run this many requests of class cls at once (the fleet is
+  // taken to be made of workers like the last one that came online).
+  void set_lanes(Work_class cls, int lanes);
+  // A request of class cls with this estimate was admitted.
+  void record_arrival(Work_class cls, double estimate);
+  // A launched worker came online this many seconds after its launch.
+  void observe_boot(double seconds);
+
+  // +1 to add a worker, -1 to retire one, 0 to stay.  num_workers are
+  // up and not being retired, num_booting launched but not up yet;
+  // backlog[c] is the estimated seconds of class c work queued or
+  // running on them.
+  int decide(double now, int num_workers, int num_booting,
+             const double backlog[NUM_WORK_CLASSES]);
+
+  friend std::ostream& operator<< (std::ostream& out, const Autoscaler& scaler);
+
+private:
+  int lanes[NUM_WORK_CLASSES];
+  double boot_seconds;
+  double arrived[NUM_WORK_CLASSES];  // since the last decision
+  double fast_rate[NUM_WORK_CLASSES];
+  double slow_rate[NUM_WORK_CLASSES];
+  double forecast[NUM_WORK_CLASSES];
+  double last_tick;         // -1 before the first decision
+  double last_change;       // when it last asked for a change
+  double shrinkable_since;  // -1 unless the shrink condition holds
+
+  double utilization(Work_class cls, int num_workers, double rate,
+                     double backlog, double delay) const;
+};
+
+#endif  // __MYSERVER_AUTOSCALER_H__
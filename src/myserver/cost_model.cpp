@@ -0,0 +1,160 @@
+#include <math.h>
+#include <string.h>
+
+#include "cost_model.h"
+
+Work_class work_class(Request_cmd cmd) {
+  switch (cmd) {
+  case CMD_PROJECTIDEA:
+    return WORK_CACHE;
+  case CMD_TELLMENOW:
+    return WORK_LIGHT;
+  default:
+    return WORK_CPU;
+  }
+}
+
+CostModel::CostModel(double arg_alpha) {
+  alpha = arg_alpha;
+  for (int i = 0; i < NUM_REQUEST_CMDS; i++) {
+    commands[i].seconds = 0.0;
+    commands[i].samples = 0;
+  }
+  for (int i = 0; i < COST_NUM_RANGES; i++) {
+    countprimes_rates[i].seconds = 0.0;
+    countprimes_rates[i].samples = 0;
+  }
+  countprimes_prior = 0.0;
+  memset(command_latencies, 0, sizeof(command_latencies));
+  memset(countprimes_latencies, 0, sizeof(countprimes_latencies));
+}
+
+void CostModel::set_prior(Request_cmd cmd, double seconds) {
+  if (commands[cmd].samples == 0) {
+    commands[cmd].seconds = seconds;
+  }
+}
+
+void CostModel::set_countprimes_prior(double seconds_per_n) {
+  countprimes_prior = seconds_per_n;
+}
+
+// floor(log2(n)), with everything below 2 in range 0
+int CostModel::range_of(int n) {
+  int range = 0;
+  while (n > 1 && range < COST_NUM_RANGES - 1) {
+    n >>= 1;
+    range++;
+  }
+  return range;
+}
+
+double CostModel::countprimes_rate(int range) const {
+  if (countprimes_rates[range].samples > 0) {
+    return countprimes_rates[range].seconds;
+  }
+  // nearest range with samples, looking below first on a tie
+  for (int d = 1; d < COST_NUM_RANGES; d++) {
+    if (range - d >= 0 && countprimes_rates[range - d].samples > 0) {
+      return countprimes_rates[range - d].seconds;
+    }
+    if (range + d < COST_NUM_RANGES && countprimes_rates[range + d].samples > 0) {
+      return countprimes_rates[range + d].seconds;
+    }
+  }
+  return countprimes_prior;
+}
+
+// both are a sieve over n numbers (for countprimesrange, n is the
+// length of the range)
+static bool is_prime_count(Request_cmd cmd) {
+  return cmd == CMD_COUNTPRIMES || cmd == CMD_COUNTPRIMESRANGE;
+}
+
+double CostModel::estimate(Request_cmd cmd, int n) const {
+  if (is_prime_count(cmd)) {
+    int units = (n > 1) ? n : 1;
+    return countprimes_rate(range_of(n)) * units;
+  }
+  return commands[cmd].seconds;
+}
+
+void CostModel::update(Cost_estimate& est, double sample) {
+  if (est.samples == 0) {
+    est.seconds = sample;
+  } else {
+    est.seconds += alpha * (sample - est.seconds);
+  }
+  est.samples++;
+}
+
+void CostModel::observe(Request_cmd cmd, int n, double seconds) {
+  if (seconds < 0.0) {
+    return;
+  }
+  if (is_prime_count(cmd)) {
+    int units = (n > 1) ? n : 1;
+    update(countprimes_rates[range_of(n)], seconds / units);
+  }
+  update(commands[cmd], seconds);
+}
+
+const Latency_histogram& CostModel::latencies_of(Request_cmd cmd, int n) const {
+  if (is_prime_count(cmd)) {
+    return countprimes_latencies[range_of(n)];
+  }
+  return command_latencies[cmd];
+}
+
+void CostModel::observe_latency(Request_cmd cmd, int n, double seconds) {
+  Latency_histogram& hist = is_prime_count(cmd) ? countprimes_latencies[range_of(n)]
+                                                : command_latencies[cmd];
+  int bucket = 0;
+  if (seconds > LATENCY_MIN_SECONDS) {
+    bucket = (int)(log2(seconds / LATENCY_MIN_SECONDS) * LATENCY_BUCKETS_PER_OCTAVE);
+    if (bucket >= LATENCY_NUM_BUCKETS) {
+      bucket = LATENCY_NUM_BUCKETS - 1;
+    }
+  }
+  hist.counts[bucket]++;
+  hist.total++;
+  if (hist.total >= LATENCY_DECAY_SAMPLES) {
+    hist.total = 0;
+    for (int i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+      hist.counts[i] /= 2;
+      hist.total += hist.counts[i];
+    }
+  }
+}
+
+double CostModel::latency_percentile(Request_cmd cmd, int n, double p) const {
+  const Latency_histogram& hist = latencies_of(cmd, n);
+  if (hist.total < LATENCY_MIN_SAMPLES) {
+    return -1.0;
+  }
+  uint32_t wanted = (uint32_t)ceil(p * hist.total);
+  uint32_t seen = 0;
+  int bucket = 0;
+  for (; bucket < LATENCY_NUM_BUCKETS - 1; bucket++) {
+    seen += hist.counts[bucket];
+    if (seen >= wanted) {
+      break;
+    }
+  }
+  // the upper edge of the bucket
+  return LATENCY_MIN_SECONDS * exp2((double)(bucket + 1) / LATENCY_BUCKETS_PER_OCTAVE);
+}
+
+std::ostream& operator<< (std::ostream& out, const CostModel& model) {
+  out << "CostModel(";
+  bool first = true;
+  for (int i = 0; i < NUM_REQUEST_CMDS; i++) {
+    if (model.commands[i].samples == 0) {
+      continue;
+    }
+    out << (first ? "" : ", ") << request_cmd_name((Request_cmd)i)
+        << "=" << model.commands[i].seconds << "s/" << model.commands[i].samples;
+    first = false;
+  }
+  return out << ")";
+}
@@ -0,0 +1,91 @@
+#ifndef __MYSERVER_COST_MODEL_H__
+#define __MYSERVER_COST_MODEL_H__
+
+#include <iostream>
+#include <stdint.h>
+
+#include "server/messages.h"
+
+// countprimes estimates are kept per power-of-two range of n
+#define COST_NUM_RANGES 32
+
+// latency histograms: buckets grow by 2^(1/4) from 0.1 ms, up to
+// about 100 s
+#define LATENCY_MIN_SECONDS 1e-4
+#define LATENCY_BUCKETS_PER_OCTAVE 4
+#define LATENCY_NUM_BUCKETS 80
+// a histogram's counts are halved when it reaches this many, so old
+// samples fade out
+#define LATENCY_DECAY_SAMPLES 1024
+// fewer samples than this give no percentile
+#define LATENCY_MIN_SAMPLES 20
+
+// The execution resources of a worker that a request competes for.
+enum Work_class {
+  WORK_CPU,    // the general pool: 418wisdom, countprimes, compareprimes
+  WORK_CACHE,  // projectidea, one running per LLC domain
+  WORK_LIGHT,  // the tellmenow priority lane
+  NUM_WORK_CLASSES
+};
+
+Work_class work_class(Request_cmd cmd);
+
+struct Cost_estimate {
+  double seconds;    // current estimate
+  uint64_t samples;  // completions it has learned from
+};
+
+struct Latency_histogram {
+  uint32_t counts[LATENCY_NUM_BUCKETS];
+  uint32_t total;
+};
+
+/*
+ * CostModel --
+ *
+ * Learns the expected service time of each command from observed
+ * completion times, as an exponentially weighted moving average with
+ * weight 'alpha' on the newest sample.  countprimes (and
+ * countprimesrange, with n the length of the range) is learned per
+ * power-of-two range of n, as seconds per unit of n; a range without
+ * samples borrows the rate of the nearest range that has some.  Until
+ * a command has samples its estimate is the prior.
+ *
+ * It also keeps a histogram of the latencies clients saw for each
+ * command (and countprimes range), for percentiles.
+ *
+ * Only used from the dispatcher, so it does no locking.
+ */
+class CostModel {
+public:
+  explicit CostModel(double alpha);
+
+  void set_prior(Request_cmd cmd, double seconds);
+  void set_countprimes_prior(double seconds_per_n);
+
+  // n is only used for countprimes and countprimesrange.
+  double estimate(Request_cmd cmd, int n) const;
+  void observe(Request_cmd cmd, int n, double seconds);
+
+  void observe_latency(Request_cmd cmd, int n, double seconds);
+  // The latency below which fraction p of the samples fall, or -1 if
+  // there are too few samples.
+  double latency_percentile(Request_cmd cmd, int n, double p) const;
+
+  friend std::ostream& operator<< (std::ostream& out, const CostModel& model);
+
+private:
+  double alpha;
+  Cost_estimate commands[NUM_REQUEST_CMDS];
+  Cost_estimate countprimes_rates[COST_NUM_RANGES];
+  double countprimes_prior;
+  Latency_histogram command_latencies[NUM_REQUEST_CMDS];
+  Latency_histogram countprimes_latencies[COST_NUM_RANGES];
+
+  static int range_of(int n);
+  double countprimes_rate(int range) const;
+  void update(Cost_estimate& est, double sample);
+  const Latency_histogram& latencies_of(Request_cmd cmd, int n) const;
+};
+
+#endif  // __MYSERVER_COST_MODEL_H__
@@ -0,0 +1,209 @@
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <map>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cpu_topology.h"
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+// Reads the first line of a sysfs file.  False if it can't be read.
+static bool read_line(const std::string& path, std::string& line) {
+  FILE* f = fopen(path.c_str(), "r");
+  if (f == NULL) {
+    return false;
+  }
+  char buf[4096];
+  bool ok = (fgets(buf, sizeof(buf), f) != NULL);
+  fclose(f);
+  if (ok) {
+    line = buf;
+  }
+  return ok;
+}
+
+// Parses a sysfs cpu list such as "0-5,12-17".
+static std::vector<int> parse_cpu_list(const std::string& list) {
+  std::vector<int> cpus;
+  const char* p = list.c_str();
+  while (*p >= '0' && *p <= '9') {
+    char* end;
+    int lo = strtol(p, &end, 10);
+    int hi = lo;
+    if (*end == '-') {
+      hi = strtol(end + 1, &end, 10);
+    }
+    for (int cpu = lo; cpu <= hi; cpu++) {
+      cpus.push_back(cpu);
+    }
+    p = (*end == ',') ? end + 1 : end;
+  }
+  return cpus;
+}
+
+static std::string cpu_dir(int cpu) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), SYSFS_CPU "/cpu%d", cpu);
+  return buf;
+}
+
+// The lowest cpu sharing the cpu's last level cache (so all the cpus
+// of one cache agree on it), or its package id if the caches aren't
+// listed, or -1.
+static int llc_key(int cpu) {
+  std::string dir = cpu_dir(cpu);
+  int best_level = 0;
+  int key = -1;
+  std::string line;
+  for (int index = 0; ; index++) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "/cache/index%d", index);
+    std::string cache = dir + buf;
+    if (!read_line(cache + "/level", line)) {
+      break;
+    }
+    int level = atoi(line.c_str());
+    std::string shared;
+    if (level > best_level && read_line(cache + "/shared_cpu_list", shared)) {
+      std::vector<int> cpus = parse_cpu_list(shared);
+      if (!cpus.empty()) {
+        best_level = level;
+        key = cpus[0];
+      }
+    }
+  }
+  if (key < 0 && read_line(dir + "/topology/physical_package_id", line)) {
+    key = atoi(line.c_str());
+  }
+  return key;
+}
+
+// The cpu's NUMA node, from the nodeN link in its directory, or -1.
+static int numa_node(int cpu) {
+  DIR* d = opendir(cpu_dir(cpu).c_str());
+  if (d == NULL) {
+    return -1;
+  }
+  int node = -1;
+  struct dirent* entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (sscanf(entry->d_name, "node%d", &node) == 1) {
+      break;
+    }
+    node = -1;
+  }
+  closedir(d);
+  return node;
+}
+
+// 0 for the first hardware thread of the cpu's core, 1 for its
+// hyperthread sibling, ...
+static int sibling_rank(int cpu) {
+  std::string line;
+  if (!read_line(cpu_dir(cpu) + "/topology/thread_siblings_list", line)) {
+    return 0;
+  }
+  std::vector<int> siblings = parse_cpu_list(line);
+  for (size_t i = 0; i < siblings.size(); i++) {
+    if (siblings[i] == cpu) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+void CpuTopology::discover() {
+  domains.clear();
+  order.clear();
+
+  std::vector<int> online;
+  std::string line;
+  if (read_line(SYSFS_CPU "/online", line)) {
+    online = parse_cpu_list(line);
+  }
+  if (online.empty()) {
+    int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int cpu = 0; cpu < num_cpus; cpu++) {
+      online.push_back(cpu);
+    }
+  }
+
+  cpu_set_t allowed;
+  bool know_allowed = (sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+
+  // domain -> hyperthread rank -> cpus
+  std::map<int, std::map<int, std::vector<int> > > by_domain;
+  std::map<int, int> domain_node;
+  for (size_t i = 0; i < online.size(); i++) {
+    int cpu = online[i];
+    if (know_allowed && (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed))) {
+      continue;
+    }
+    int key = llc_key(cpu);
+    by_domain[key][sibling_rank(cpu)].push_back(cpu);
+    if (domain_node.count(key) == 0) {
+      domain_node[key] = numa_node(cpu);
+    }
+  }
+  if (by_domain.empty()) {
+    by_domain[0][0].push_back(0);
+    domain_node[0] = -1;
+  }
+
+  // each domain's cpus, first threads of cores first
+  for (auto d = by_domain.begin(); d != by_domain.end(); ++d) {
+    Llc_domain domain;
+    domain.node = domain_node[d->first];
+    for (auto r = d->second.begin(); r != d->second.end(); ++r) {
+      domain.cpus.insert(domain.cpus.end(), r->second.begin(), r->second.end());
+    }
+    domains.push_back(domain);
+  }
+
+  // then deal them out a domain at a time
+  for (size_t i = 0; ; i++) {
+    bool any = false;
+    for (size_t d = 0; d < domains.size(); d++) {
+      if (i < domains[d].cpus.size()) {
+        order.push_back(domains[d].cpus[i]);
+        any = true;
+      }
+    }
+    if (!any) {
+      break;
+    }
+  }
+}
+
+// The memory policy is only a preference, and left alone where the
+// kernel won't set one (no NUMA support, or a sandbox): the pages are
+// then placed by first touch, which is on the domain's node anyway
+// once the thread runs there.
+static void prefer_node(int node) {
+  if (node < 0 || node >= (int)(8 * sizeof(unsigned long))) {
+    return;
+  }
+  unsigned long mask = 1UL << node;
+  syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, 8 * sizeof(mask));
+}
+
+void enter_domain(const Llc_domain& domain, cpu_set_t& saved) {
+  pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved);
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (size_t i = 0; i < domain.cpus.size(); i++) {
+    CPU_SET(domain.cpus[i], &set);
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  prefer_node(domain.node);
+}
+
+void leave_domain(const cpu_set_t& saved) {
+  syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+  pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+}
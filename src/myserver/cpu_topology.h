@@ -0,0 +1,45 @@
+#ifndef __MYSERVER_CPU_TOPOLOGY_H__
+#define __MYSERVER_CPU_TOPOLOGY_H__
+
+#include <sched.h>
+#include <vector>
+
+// One last level cache and the cpus that share it (a socket on the
+// latedays nodes)
+struct Llc_domain {
+  std::vector<int> cpus;
+  int node;  // NUMA node of those cpus, -1 if unknown
+};
+
+/*
+ * CpuTopology --
+ *
+ * The node's cpus grouped by the last level cache they share, as read
+ * from /sys/devices/system/cpu.  Only cpus this process may run on are
+ * included.  If sysfs can't be read, all online cpus form one domain.
+ */
+class CpuTopology {
+public:
+  void discover();
+
+  int num_domains() const { return domains.size(); }
+  const Llc_domain& domain(int d) const { return domains[d]; }
+
+  // The cpus to pin pool threads to, in order: one hardware thread of
+  // each core before any hyperthread sibling, alternating between
+  // domains, so a pool smaller than the node still gets a core of its
+  // own per thread and both caches.
+  const std::vector<int>& thread_cpus() const { return order; }
+
+private:
+  std::vector<Llc_domain> domains;
+  std::vector<int> order;
+};
+
+// Restricts the calling thread to the domain's cpus, and has the pages
+// it faults in from now on come from the domain's NUMA node.  'saved'
+// receives the thread's previous cpus for leave_domain.
+void enter_domain(const Llc_domain& domain, cpu_set_t& saved);
+void leave_domain(const cpu_set_t& saved);
+
+#endif  // __MYSERVER_CPU_TOPOLOGY_H__
@@ -1,31 +1,83 @@
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <deque>
+#include <queue>
 #include <unordered_map>
+#include <vector>
 
 #include "server/messages.h"
 #include "server/master.h"
 #include "tools/work_queue.h"
+#include "tools/indexed_heap.h"
 
 #include "tools/cycle_timer.h"
+#include "response_cache.h"
+#include "cost_model.h"
+#include "autoscaler.h"
+#include "prime_ranges.h"
 #include <iostream>
 
-//MAX_WORKERS is just used so we have a static value for creating
-//a fixed size array of worker states, but we do use the max_num_workers
-//parameter in our code when deciding to launch workers
-#define MAX_WORKERS 4 
-#define MAX_THREADS 48
+//response cache budget
+#define CACHE_CAPACITY_BYTES (64 * 1024 * 1024)
+#define CACHE_NUM_SHARDS 16
+
+//weight of the newest completion in the service time estimates
+#define COST_ALPHA 0.2
+//requests of each class a worker may have outstanding.  The rest wait
+//in the master, where they can still be ordered and placed.  CPU
+//requests get this many per hardware thread the worker advertised,
+//projectidea per LLC domain: one running and one on its way, so no
+//context or cache idles between them
+#define WORKER_CPU_SLOTS_PER_CONTEXT 2
+#define WORKER_CACHE_SLOTS_PER_DOMAIN 2
+#define WORKER_LIGHT_SLOTS 16
+//a request still unanswered when its age passes this percentile of its
+//command's latency is also sent to another, less loaded worker, and
+//whichever copy answers first wins
+#define HEDGE_PERCENTILE 0.95
+//never hedge sooner than this, nor have more hedges than this out
+#define HEDGE_MIN_DELAY 0.05
+#define MAX_OUTSTANDING_HEDGES 8
+//what a worker is assumed to take to boot until one has been seen to
+#define WORKER_BOOT_SECONDS 1.5
+//hardware threads assumed of a worker that doesn't advertise them:
+//the dual-core instances the workers were first written for
+#define DEFAULT_WORKER_CONTEXTS 2
+#define DEFAULT_WORKER_LLC_DOMAINS 1
+
+DEFINE_string(cache_policy, "lru",
+              "Response cache eviction policy: 'lru' or 'clock' (second "
+              "chance, cheaper hits).");
+DEFINE_string(prime_index_file, "",
+              "File the workers keep their prime index in, so a new worker "
+              "starts with the index earlier ones built (empty for none).");
+DEFINE_bool(pull_dispatch, false,
+            "Have the workers grant dispatch slots themselves, from their "
+            "actual state, instead of the master's fixed per-worker limits.");
 
 struct Worker_state {
   bool is_alive;
 
   bool to_be_killed; //need to initialize to false
-  int num_cpu_intense_requests;
-  int num_non_intense_requests; //this would be like tellmenow
+  //sent a DRAIN and its DRAINED hasn't come back: requests it handed
+  //back may still be on their way
+  bool draining;
+
+  //outstanding requests and their estimated seconds of work, for each
+  //class of execution resource on the worker
+  int num_requests[NUM_WORK_CLASSES];
+  double est_seconds[NUM_WORK_CLASSES];
+  double last_done_at[NUM_WORK_CLASSES];
+  int granted_slots[NUM_WORK_CLASSES]; //pull mode only
+  //hardware threads the worker advertised: that's how many pool
+  //requests make progress at once however many threads the pool has
+  int num_contexts;
+  //last-level caches the worker advertised, one projectidea in each
+  int num_llc_domains;
 
-  int weighted_countprimes_requests;
-
-  int num_cache_intense_requests;
   int num_pending_requests; //this is the total number of pending reqs
   Worker_handle worker_handle;
 };
@@ -42,37 +94,137 @@ static struct Master_state {
   int num_pending_client_requests;
   int next_tag;
   int num_alive_workers;
+  //launched but not online yet, and when they were launched
+  int num_booting;
+  std::deque<double> launch_times;
   int num_to_be_killed;
   bool last_req_seen;
+  int num_coalesced_requests;
+  int num_hedged_requests;
+  int num_hedges_won; //the copy answered first
+  int num_returned_requests; //handed back by draining workers
 
   std::unordered_map<int,Client_handle> tagMap;
 
-  Worker_state worker_states[MAX_WORKERS];
+  //every worker that has come online gets a slot in worker_states,
+  //which is reused once the worker is killed
+  std::vector<Worker_state> worker_states;
+  std::vector<int> free_worker_idxs;
+  std::unordered_map<Worker_handle, int> handleToIdxMap;
 
 } mstate;
 
-//stores the countprimes partial results of compareprimes
+//stores the partial result of compareprimes: the weighted sum of the
+//range counts received so far (see compareprimes_ranges)
 struct cmp_primes_data {
-  int counts[4];
-  int num_received;
+  int weights[MAX_COMPAREPRIMES_RANGES];
+  int diff;
+  int num_remaining;
+};
+
+//a client request that has been sent to a worker.  Identical requests
+//arriving while it is pending are not sent again; their clients wait
+//here for the same response
+struct In_flight {
+  uint64_t fingerprint;
+  std::string cmd;
+  bool cacheable;
+  std::vector<Client_handle> waiters;
 };
 
-std::unordered_map<int, std::string> tagToReqMap;
-std::unordered_map<int, std::string> tagToTypeMap; //the string is type we define
+std::unordered_map<int, In_flight> tagToInFlightMap;
+std::unordered_map<uint64_t, int> fingerprintToTagMap;
+//a request sent to a worker, kept until its response arrives so the
+//worker's load and the cost model can be updated
+struct Dispatched {
+  int worker_idx;
+  Request_cmd cmd;
+  int n; //countprimes: n, countprimesrange: length of the range
+  double estimate;
+  double sent_at;
+  Request_msg req; //to send again if it is hedged
+};
+
+std::unordered_map<int, Dispatched> tagToDispatchedMap;
+//the second copy of a hedged request
+std::unordered_map<int, Dispatched> tagToHedgeMap;
+//the copy that lost, after the other one answered.  Its answer (or
+//the empty one sent after the cancel) only frees up its worker
+std::unordered_map<int, Dispatched> tagToLateMap;
+
+//when each dispatched request is due to be hedged, soonest first
+typedef std::pair<double, int> Hedge_timer;
+static std::priority_queue<Hedge_timer, std::vector<Hedge_timer>,
+                           std::greater<Hedge_timer> > hedge_timers;
 std::unordered_map<int, int> cmpPrimeTagToTagMap;
 std::unordered_map<int, cmp_primes_data> tagToCmpPrimesDataMap;
-std::unordered_map<int, int> tagToPrimeMap;
 
-static struct Request_cache {
-  std::unordered_map<std::string, Response_msg> respMap;
-} req_cache;
 
+//a request admitted by the master but not yet sent to a worker
+struct Queued_request {
+  Request_msg req;
+  Request_cmd cmd;
+  int n;
+};
+
+//one admission queue per class, dispatched in priority order
+static std::deque<Queued_request> admission_queues[NUM_WORK_CLASSES];
+static const Work_class class_priority[NUM_WORK_CLASSES] = {
+  WORK_LIGHT, WORK_CACHE, WORK_CPU
+};
+static void dispatch_admitted();
+
+//every command is deterministic, so by default all responses are
+//admitted and never expire.  Per-command rules can be added with
+//req_cache.set_rule in master_node_init, which also sets the policy
+//from --cache_policy.
+static ResponseCache req_cache(CACHE_CAPACITY_BYTES, CACHE_NUM_SHARDS, CACHE_LRU);
+static CostModel cost_model(COST_ALPHA);
+
+//the workers that can take a request of each class now (alive, staying
+//and with a free slot), by their backlog in that class per lane
+static IndexedHeap<double> dispatch_heaps[NUM_WORK_CLASSES];
+//the workers that are staying, by their total backlog
+static IndexedHeap<double> load_heap;
+static Autoscaler autoscaler(WORKER_BOOT_SECONDS);
+
+//how many requests of class cls worker ws runs at once: CPU requests
+//on every hardware thread, projectidea one per LLC domain and
+//tellmenow one at a time
+static int worker_lanes(const Worker_state& ws, Work_class cls){
+  switch(cls){
+  case WORK_CPU:
+    return ws.num_contexts;
+  case WORK_CACHE:
+    return ws.num_llc_domains;
+  default:
+    return 1;
+  }
+}
 
-void master_node_init(int max_workers, int& tick_period) {
 
-  // set up tick handler to fire every 5 seconds. (feel free to
-  // configure as you please)
-  tick_period = 4;
+//asks for a new worker, telling it how it will be given work and
+//where to keep its prime index
+static void launch_worker() {
+  int tag = random();
+  Request_msg req(tag);
+  req.set_arg("name", "my worker 0");
+  if(FLAGS_pull_dispatch){
+    req.set_arg("dispatch", "pull");
+  }
+  if(!FLAGS_prime_index_file.empty()){
+    req.set_arg("prime_index_file", FLAGS_prime_index_file);
+  }
+  request_new_worker_node(req);
+  mstate.num_booting++;
+  mstate.launch_times.push_back(CycleTimer::currentSeconds());
+}
+
+void master_node_init(int max_workers, double& tick_period) {
+
+  // the tick drives the autoscaler and the hedge timers, so it runs
+  // well under a second
+  tick_period = 0.25;
   
   mstate.next_tag = 0;
   mstate.max_num_workers = max_workers;
@@ -80,6 +232,7 @@ void master_node_init(int max_workers, int& tick_period) {
 
   mstate.num_alive_workers = 0;
   mstate.num_to_be_killed = 0;
+  mstate.num_booting = 0;
 
   // don't mark the server as ready until the server is ready to go.
   // This is actually when the first worker is up and running, not
@@ -87,48 +240,104 @@ void master_node_init(int max_workers, int& tick_period) {
   mstate.server_ready = false;
 
   mstate.last_req_seen = false;
+  mstate.num_coalesced_requests = 0;
+  mstate.num_hedged_requests = 0;
+  mstate.num_hedges_won = 0;
+  mstate.num_returned_requests = 0;
+
+  req_cache.set_policy(FLAGS_cache_policy == "clock" ? CACHE_CLOCK : CACHE_LRU);
+
+  //rough service times until real ones have been observed
+  cost_model.set_prior(CMD_418WISDOM, 0.35);
+  cost_model.set_prior(CMD_PROJECTIDEA, 0.25);
+  cost_model.set_prior(CMD_TELLMENOW, 0.0001);
+  cost_model.set_countprimes_prior(1e-8);
+
   // fire off a request for a new worker
+  launch_worker();
 
-  // initialize array of workers - bc it dont work elsewhere
-  for(int i = 0; i < MAX_WORKERS; i++){
-    Worker_state ws;
-    ws.num_cache_intense_requests = 0;
-    ws.num_cpu_intense_requests = 0;
-    ws.num_non_intense_requests = 0;
-    ws.weighted_countprimes_requests = 0;
-    ws.num_pending_requests = 0;
-    ws.to_be_killed = false;
-    ws.is_alive = false;
-    mstate.worker_states[i] = ws;
+}
+
+//how many requests of class cls worker ws may have outstanding
+static int worker_slots(const Worker_state& ws, Work_class cls){
+  switch(cls){
+  case WORK_CPU:
+    return WORKER_CPU_SLOTS_PER_CONTEXT * ws.num_contexts;
+  case WORK_CACHE:
+    return WORKER_CACHE_SLOTS_PER_DOMAIN * ws.num_llc_domains;
+  default:
+    return WORKER_LIGHT_SLOTS;
   }
+}
 
-  int tag = random();
-  Request_msg req(tag);
-  req.set_arg("name", "my worker 0");
-  request_new_worker_node(req);
+static bool has_free_slot(const Worker_state& ws, Work_class cls){
+  if(FLAGS_pull_dispatch){
+    return ws.granted_slots[cls] > 0;
+  }
+  return ws.num_requests[cls] < worker_slots(ws, cls);
+}
 
+//puts worker idx where it now belongs in the heaps.  Called after
+//anything that changes its load, its slots or whether it is staying
+static void update_worker_keys(int idx){
+  const Worker_state& ws = mstate.worker_states[idx];
+  bool staying = ws.is_alive && !ws.to_be_killed;
+  double load = 0;
+  for(int c = 0; c < NUM_WORK_CLASSES; c++){
+    load += ws.est_seconds[c];
+    if(staying && has_free_slot(ws, (Work_class)c)){
+      dispatch_heaps[c].set(idx, ws.est_seconds[c] / worker_lanes(ws, (Work_class)c));
+    }
+    else{
+      dispatch_heaps[c].remove(idx);
+    }
+  }
+  if(staying){
+    load_heap.set(idx, load);
+  }
+  else{
+    load_heap.remove(idx);
+  }
 }
 
-void handle_new_worker_online(Worker_handle worker_handle, int tag) {
+void handle_new_worker_online(Worker_handle worker_handle, int tag,
+                              int num_contexts, int num_llc_domains) {
   int idx;
-  for(int i = 0; i < mstate.max_num_workers; i++){
-    Worker_state ws = mstate.worker_states[i];
-    if(!ws.is_alive){
-      idx = i;
-      break;
-    } 
+  if(!mstate.free_worker_idxs.empty()){
+    idx = mstate.free_worker_idxs.back();
+    mstate.free_worker_idxs.pop_back();
+  }
+  else{
+    idx = mstate.worker_states.size();
+    mstate.worker_states.push_back(Worker_state());
   }
   mstate.worker_states[idx].is_alive = true;
 
-  mstate.worker_states[idx].num_cache_intense_requests = 0;
-  mstate.worker_states[idx].num_cpu_intense_requests = 0;
-  mstate.worker_states[idx].num_non_intense_requests = 0;
-  mstate.worker_states[idx].weighted_countprimes_requests = 0;
+  for(int c = 0; c < NUM_WORK_CLASSES; c++){
+    mstate.worker_states[idx].num_requests[c] = 0;
+    mstate.worker_states[idx].est_seconds[c] = 0;
+    mstate.worker_states[idx].last_done_at[c] = 0;
+    mstate.worker_states[idx].granted_slots[c] = 0;
+  }
   mstate.worker_states[idx].num_pending_requests = 0;
   mstate.worker_states[idx].to_be_killed = false;
+  mstate.worker_states[idx].draining = false;
+  mstate.worker_states[idx].num_contexts =
+    (num_contexts > 0) ? num_contexts : DEFAULT_WORKER_CONTEXTS;
+  mstate.worker_states[idx].num_llc_domains =
+    (num_llc_domains > 0) ? num_llc_domains : DEFAULT_WORKER_LLC_DOMAINS;
+  autoscaler.set_lanes(WORK_CPU, mstate.worker_states[idx].num_contexts);
+  autoscaler.set_lanes(WORK_CACHE, mstate.worker_states[idx].num_llc_domains);
   
   mstate.worker_states[idx].worker_handle = worker_handle;
+  mstate.handleToIdxMap[worker_handle] = idx;
+  update_worker_keys(idx);
   mstate.num_alive_workers++;
+  if(mstate.num_booting > 0){
+    autoscaler.observe_boot(CycleTimer::currentSeconds() - mstate.launch_times.front());
+    mstate.launch_times.pop_front();
+    mstate.num_booting--;
+  }
 
   // Now that a worker is booted, let the system know the server is
   // ready to begin handling client requests.  The test harness will
@@ -137,114 +346,83 @@ void handle_new_worker_online(Worker_handle worker_handle, int tag) {
     server_init_complete();
     mstate.server_ready = true;
   }
+  dispatch_admitted();
 }
 
-void handle_worker_response(Worker_handle worker_handle, const Response_msg& resp) {
-
-  // Master node has received a response from one of its workers.
-  // Here we directly return this response to the client.
-
-  DLOG(INFO) << "Master received a response from a worker: [" << resp.get_tag() << ":" << resp.get_response() << "]" << std::endl;
-  
-  //flags to make our logic work because we send compareprimes result separately
-  bool send_response = true;
-  bool sent_cmpprimes_resp = false;
-  int tag = resp.get_tag();
-  Client_handle client_handle;
-
-  if(mstate.tagMap.find(tag) != mstate.tagMap.end()){
-    client_handle = mstate.tagMap.at(tag);
+//takes a finished copy of a request off its worker's load and, if it
+//was the one that answered (with resp), teaches the cost model how
+//long it took
+static void retire(const Dispatched& d, const Response_msg* resp){
+  Work_class cls = work_class(d.cmd);
+  Worker_state& ws = mstate.worker_states[d.worker_idx];
+  ws.num_pending_requests--;
+  ws.num_requests[cls]--;
+  ws.est_seconds[cls] -= d.estimate;
+  if(ws.num_requests[cls] == 0){
+    ws.est_seconds[cls] = 0; //don't let rounding drift build up
   }
 
-  //check if this response was one of the countprimes subjob for compareprimes
-  if(cmpPrimeTagToTagMap.find(tag) != cmpPrimeTagToTagMap.end()){
-    send_response = false;
-    int parentTag = cmpPrimeTagToTagMap.at(tag);
-    int idx = tag - parentTag;
-    
-    tagToCmpPrimesDataMap.at(parentTag).counts[idx] = atoi(resp.get_response().c_str());
-    tagToCmpPrimesDataMap.at(parentTag).num_received++;
-    if(tagToCmpPrimesDataMap.at(parentTag).num_received == 4){
-      cmp_primes_data data = tagToCmpPrimesDataMap.at(parentTag);
-      Response_msg cmpprimes_resp(parentTag);
-      if(data.counts[1] - data.counts[0] > data.counts[3] - data.counts[2]){
-        cmpprimes_resp.set_response("There are more primes in first range.");
-      }
-      else{
-        cmpprimes_resp.set_response("There are more primes in second range.");
-      }
-      client_handle = mstate.tagMap.at(parentTag);
-      send_client_response(client_handle, cmpprimes_resp);
-      tagToCmpPrimesDataMap.erase(parentTag);
-      send_response = true;
-      sent_cmpprimes_resp = true;
-      mstate.tagMap.erase(parentTag);
-      tag = parentTag;
-    }
-    cmpPrimeTagToTagMap.erase(tag);
+  //the worker reports how long the request ran, without the time it
+  //waited in the worker's queues.  A worker that doesn't (a legacy
+  //one) is timed from here: a single lane runs its requests one after
+  //another, so the time spent behind the previous one isn't service
+  //time
+  double now = CycleTimer::currentSeconds();
+  double started = d.sent_at;
+  if(worker_lanes(ws, cls) == 1 && ws.last_done_at[cls] > started){
+    started = ws.last_done_at[cls];
   }
-
-  //this should only happen when compareprimes is not ready send response yet
-  if(!send_response){
-    return;
+  ws.last_done_at[cls] = now;
+  if(resp != NULL){
+    double seconds = resp->get_run_seconds();
+    cost_model.observe(d.cmd, d.n, (seconds > 0) ? seconds : now - started);
   }
-  if(!sent_cmpprimes_resp){
-    send_client_response(client_handle, resp);
-    mstate.tagMap.erase(tag);
-  }
-  mstate.num_pending_client_requests--;
-
+  update_worker_keys(d.worker_idx);
+}
 
-  if(tagToReqMap.find(tag) != tagToReqMap.end()){
-    std::string req_string = tagToReqMap.at(tag);
-    req_cache.respMap.insert(std::pair<std::string, Response_msg>(req_string, resp));
+//kills the worker if it's been flagged and it's done with work
+static void kill_if_drained(int idx){
+  Worker_state& ws = mstate.worker_states[idx];
+  if(ws.to_be_killed && ws.num_pending_requests == 0){
+    // update node to indicate done
+    ws.to_be_killed = false;
+    ws.is_alive = false;
+    kill_worker_node(ws.worker_handle);
+    mstate.num_alive_workers--;
+    mstate.num_to_be_killed--;
+    mstate.handleToIdxMap.erase(ws.worker_handle);
+    mstate.free_worker_idxs.push_back(idx);
+    update_worker_keys(idx);
   }
+}
 
-  //search for the worker
-  for(int i = 0; i < mstate.max_num_workers; i++){
-    Worker_state ws = mstate.worker_states[i];
-    if(ws.is_alive && ws.worker_handle == worker_handle){
-      ws.num_pending_requests--;
-      //by the way we set this up, every request should have one of these 3 types
-      std::string type = tagToTypeMap.at(tag);
-      if(type == "cache"){
-        ws.num_cache_intense_requests--;
-      }  
-      else if(type == "cpu"){
-        ws.num_cpu_intense_requests--;
-      }
-      else if(type == "non"){
-        ws.num_non_intense_requests--;
-      }
-      tagToTypeMap.erase(tag);
-
-      //decrement the weighted count for countprimes requests
-      if(tagToPrimeMap.find(tag) != tagToPrimeMap.end()){
-        int cat = tagToPrimeMap.at(tag);
-        ws.weighted_countprimes_requests -= cat;
-        tagToPrimeMap.erase(tag);
-      }
+static int find_worker_idx(Worker_handle worker_handle){
+  auto it = mstate.handleToIdxMap.find(worker_handle);
+  return (it == mstate.handleToIdxMap.end()) ? -1 : it->second;
+}
 
-      //summing up manually because ws.num_pending_requests is wrong
-      int totalRequests = ws.num_cache_intense_requests + ws.num_cpu_intense_requests + ws.num_non_intense_requests;
-      //kill the worker if it's been flagged and it's done with work
-      if(ws.to_be_killed && totalRequests == 0){
-        // update node to indicate done
-        ws.to_be_killed = false;
-        ws.is_alive = false;
-        kill_worker_node(ws.worker_handle);
-        mstate.num_alive_workers--;
-        mstate.num_to_be_killed--;
-      }
+//answers the client request 'tag', and every identical request that
+//was waiting on it
+static void finish_client_request(int tag, const Response_msg& client_resp) {
+  send_client_response(mstate.tagMap.at(tag), client_resp);
+  mstate.tagMap.erase(tag);
+  mstate.num_pending_client_requests--;
 
-      mstate.worker_states[i] = ws;
-      break;
+  if(tagToInFlightMap.find(tag) != tagToInFlightMap.end()){
+    In_flight& flight = tagToInFlightMap.at(tag);
+    for(size_t i = 0; i < flight.waiters.size(); i++){
+      send_client_response(flight.waiters[i], client_resp);
+    }
+    if(flight.cacheable){
+      req_cache.insert(flight.fingerprint, flight.cmd, client_resp);
     }
+    fingerprintToTagMap.erase(flight.fingerprint);
+    tagToInFlightMap.erase(tag);
   }
 
   //this should be the end
   if(mstate.last_req_seen && mstate.num_pending_client_requests == 0){
-    for(int i = 0; i < mstate.max_num_workers; i++){
+    for(size_t i = 0; i < mstate.worker_states.size(); i++){
       //we're not setting is_alive to false because we should be done at this point      
       if(mstate.worker_states[i].is_alive){
         kill_worker_node(mstate.worker_states[i].worker_handle);
@@ -252,325 +430,464 @@ void handle_worker_response(Worker_handle worker_handle, const Response_msg& res
       }
     }
   }
-
 }
 
-int find_min_primes_idx(){ 
-  int curr_min;
-  int selected_idx;
-  bool has_begun = false;
-  for(int i = 0; i < mstate.max_num_workers; i++){
-    Worker_state ws = mstate.worker_states[i];
-    if(!ws.is_alive || ws.to_be_killed){
-      continue;
-    }
-    if(ws.is_alive && !has_begun){
-      curr_min = ws.weighted_countprimes_requests;
-      selected_idx = i;
-      has_begun = true;
-    }
-    else if(ws.is_alive){
-      if(ws.weighted_countprimes_requests < curr_min){
-        curr_min = ws.weighted_countprimes_requests;
-        selected_idx = i;
-      }
-    }
+static Response_msg compareprimes_response(int tag, int diff) {
+  Response_msg resp(tag);
+  if(diff > 0){
+    resp.set_response("There are more primes in first range.");
   }
-  return selected_idx;
+  else{
+    resp.set_response("There are more primes in second range.");
+  }
+  return resp;
 }
 
-int find_min_cache_idx(){
-  int curr_min;
-  int selected_idx;
-  bool has_begun = false;
-  for(int i = 0; i < mstate.max_num_workers; i++){
-    Worker_state ws = mstate.worker_states[i];
-    if(!ws.is_alive || ws.to_be_killed){
-      continue;
-    }
-    if(ws.is_alive && !has_begun){
-      curr_min = ws.num_cache_intense_requests;
-      selected_idx = i;
-      has_begun = true;
-    }
-    else if(ws.is_alive){
-      if(ws.num_cache_intense_requests < curr_min){
-        curr_min = ws.num_cache_intense_requests;
-        selected_idx = i;
-      }
-    }
+void handle_worker_response(Worker_handle worker_handle, const Response_msg& resp) {
+
+  // Master node has received a response from one of its workers.
+  // Here we directly return this response to the client.
+
+  DLOG(INFO) << "Master received a response from a worker: [" << resp.get_tag() << ":" << resp.get_response() << "]" << std::endl;
+
+  int tag = resp.get_tag();
+  int worker_idx = find_worker_idx(worker_handle);
+  //e.g. still on its way from a worker that has just been killed
+  if(worker_idx < 0){
+    LOG(WARNING) << "Dropping response " << tag << " from an unknown worker";
+    return;
   }
-  return selected_idx;
-}
-int find_min_non_idx(){
-  int curr_min;
-  int selected_idx;
-  bool has_begun = false;
-  for(int i = 0; i < mstate.max_num_workers; i++){
-    Worker_state ws = mstate.worker_states[i];
-    if(!ws.is_alive || ws.to_be_killed){
-      continue;
-    }
-    if(ws.is_alive && !has_begun){
-      curr_min = ws.num_non_intense_requests;
-      selected_idx = i;
-      has_begun = true;
-    }
-    else if(ws.is_alive){
-      if(ws.num_non_intense_requests < curr_min){
-        curr_min = ws.num_non_intense_requests;
-        selected_idx = i;
+
+  //every response, including compareprimes parts, frees up its worker.
+  //Of the two copies of a hedged request the first to answer wins and
+  //the other is cancelled; its answer is dropped when it comes
+  bool late = false;
+  if(tagToLateMap.find(tag) != tagToLateMap.end() &&
+     tagToLateMap.at(tag).worker_idx == worker_idx){
+    retire(tagToLateMap.at(tag), NULL);
+    tagToLateMap.erase(tag);
+    late = true;
+  }
+  else{
+    Dispatched first = tagToDispatchedMap.at(tag);
+    tagToDispatchedMap.erase(tag);
+    cost_model.observe_latency(first.cmd, first.n,
+                               CycleTimer::currentSeconds() - first.sent_at);
+    if(tagToHedgeMap.find(tag) != tagToHedgeMap.end()){
+      Dispatched copy = tagToHedgeMap.at(tag);
+      tagToHedgeMap.erase(tag);
+      if(copy.worker_idx == worker_idx){
+        std::swap(first, copy);
+        mstate.num_hedges_won++;
       }
+      cancel_worker_request(mstate.worker_states[copy.worker_idx].worker_handle, tag);
+      tagToLateMap.insert(std::pair<int, Dispatched>(tag, copy));
     }
+    retire(first, &resp);
   }
-  return selected_idx;
-}
-int find_min_cpu_idx(){
-  int curr_min;
-  bool has_begun = false;
-  int selected_idx;
-  for(int i = 0; i < mstate.max_num_workers; i++){
-    Worker_state ws = mstate.worker_states[i];
-    if(!ws.is_alive || ws.to_be_killed){
-      continue;
-    }
-    if(ws.is_alive && !has_begun){
-      curr_min = ws.num_cpu_intense_requests;
-      selected_idx = i;
-      has_begun = true;
-    }
-    else if(ws.is_alive){
-      if(ws.num_cpu_intense_requests < curr_min){
-        curr_min = ws.num_cpu_intense_requests;
-        selected_idx = i;
-      }
+  dispatch_admitted();
+
+  kill_if_drained(worker_idx);
+  if(late){
+    return;
+  }
+
+  //check if this response was one of the range counts of a compareprimes
+  if(cmpPrimeTagToTagMap.find(tag) != cmpPrimeTagToTagMap.end()){
+    int parentTag = cmpPrimeTagToTagMap.at(tag);
+    int idx = tag - parentTag;
+    cmpPrimeTagToTagMap.erase(tag);
+    
+    cmp_primes_data& data = tagToCmpPrimesDataMap.at(parentTag);
+    data.diff += data.weights[idx] * atoi(resp.get_response().c_str());
+    //not ready to send the response yet
+    if(--data.num_remaining > 0){
+      return;
     }
+    Response_msg cmpprimes_resp = compareprimes_response(parentTag, data.diff);
+    tagToCmpPrimesDataMap.erase(parentTag);
+    finish_client_request(parentTag, cmpprimes_resp);
+    return;
   }
-  return selected_idx;
+
+  finish_client_request(tag, resp);
 }
 
 //used when looking for worker to delete
 int find_min_load_idx(){
-  int curr_min;
-  bool has_begun = false;
-  int selected_idx;
-  for(int i = 0; i < mstate.max_num_workers; i++){
-    Worker_state ws = mstate.worker_states[i];
-    if(!ws.is_alive || ws.to_be_killed){
-      continue;
-    }
-    if(ws.is_alive && !has_begun){
-      curr_min = ws.num_cpu_intense_requests + ws.num_cache_intense_requests;
-      selected_idx = i;
-      has_begun = true;
-    }
-    else if(ws.is_alive){
-      if(ws.num_cpu_intense_requests + ws.num_cache_intense_requests < curr_min){
-        curr_min = ws.num_cpu_intense_requests + ws.num_cache_intense_requests;
-        selected_idx = i;
-      }
-    }
-  }
-  return selected_idx;
+  return load_heap.empty() ? -1 : load_heap.top();
 }
-int choose_worker_idx(int tag){
-  int curr_min;
-  bool has_begun = false;
-  int selected_idx;
 
-  std::string type = tagToTypeMap.at(tag);
+//the worker with a free slot for class cls that is expected to finish
+//a request of that class first: the one whose backlog in the class,
+//spread over the class's lanes, is smallest.  -1 if every worker's
+//slots are taken
+int choose_worker_idx(Work_class cls, int exclude_idx = -1){
+  return dispatch_heaps[cls].top_excluding(exclude_idx);
+}
+
+//charges a request's estimate to worker idx, which it is about to be
+//sent to
+static Dispatched charge_worker(int idx, const Request_msg& worker_req,
+                               Request_cmd cmd, int n, double estimate){
+  Worker_state& ws = mstate.worker_states[idx];
+  Work_class cls = work_class(cmd);
+  ws.num_requests[cls]++;
+  ws.est_seconds[cls] += estimate;
+  ws.num_pending_requests++;
+  if(FLAGS_pull_dispatch){
+    ws.granted_slots[cls]--;
+  }
+  update_worker_keys(idx);
+
+  Dispatched d;
+  d.worker_idx = idx;
+  d.cmd = cmd;
+  d.n = n;
+  d.estimate = estimate;
+  d.sent_at = CycleTimer::currentSeconds();
+  d.req = worker_req;
+  return d;
+}
 
-  if(type == "cache"){
-    return find_min_cache_idx();
+//sends a request to worker idx, and sets a timer to hedge it once the
+//command has enough latency samples to tell when it is straggling
+static void send_to_worker(int idx, const Request_msg& worker_req, Request_cmd cmd,
+                           int n, double estimate){
+  Dispatched d = charge_worker(idx, worker_req, cmd, n, estimate);
+  tagToDispatchedMap[worker_req.get_tag()] = d;
+
+  double p = cost_model.latency_percentile(cmd, n, HEDGE_PERCENTILE);
+  if(p > 0 && mstate.num_alive_workers > 1){
+    hedge_timers.push(Hedge_timer(d.sent_at + std::max(p, HEDGE_MIN_DELAY),
+                                  worker_req.get_tag()));
   }
-  else if(type == "cpu"){
-    if(tagToPrimeMap.find(tag) != tagToPrimeMap.end()){
-      return find_min_primes_idx();
+
+  send_request_to_worker(mstate.worker_states[idx].worker_handle, worker_req);
+}
+
+//sends a second copy of each request whose hedge timer has gone off to
+//a worker that has a free slot and less of that class queued than the
+//one that is running it
+static void hedge_stragglers(){
+  double now = CycleTimer::currentSeconds();
+  while(!hedge_timers.empty() && hedge_timers.top().first <= now){
+    int tag = hedge_timers.top().second;
+    hedge_timers.pop();
+    if(tagToDispatchedMap.find(tag) == tagToDispatchedMap.end() ||
+       tagToHedgeMap.find(tag) != tagToHedgeMap.end() ||
+       tagToHedgeMap.size() >= MAX_OUTSTANDING_HEDGES){
+      continue;
     }
-    else{
-      return find_min_cpu_idx();
+    const Dispatched& d = tagToDispatchedMap.at(tag);
+    Work_class cls = work_class(d.cmd);
+    int idx = choose_worker_idx(cls, d.worker_idx);
+    if(idx < 0 ||
+       mstate.worker_states[idx].est_seconds[cls] >=
+       mstate.worker_states[d.worker_idx].est_seconds[cls]){
+      continue;
     }
+    DLOG(INFO) << "Hedging " << tag << " on worker " << idx << std::endl;
+    tagToHedgeMap.insert(std::pair<int, Dispatched>(
+        tag, charge_worker(idx, d.req, d.cmd, d.n, d.estimate)));
+    mstate.num_hedged_requests++;
+    send_request_to_worker(mstate.worker_states[idx].worker_handle, d.req);
   }
-  else if(type == "non"){
-    return find_min_non_idx();
-  }
-  //shouldn't get here
-  else{
-    return -1;
-  }
+}
 
-  return selected_idx;
+//queues a request until a worker has a free slot for it
+static void admit(const Request_msg& worker_req, Request_cmd cmd, int n){
+  Queued_request q;
+  q.req = worker_req;
+  q.cmd = cmd;
+  q.n = n;
+  admission_queues[work_class(cmd)].push_back(q);
+  autoscaler.record_arrival(work_class(cmd), cost_model.estimate(cmd, n));
 }
 
-// Generate a valid 'countprimes' request dictionary from integer 'n'
-static void create_computeprimes_req(Request_msg& req, int n) {
-  std::ostringstream oss;
-  oss << n;
-  req.set_arg("cmd", "countprimes");
-  req.set_arg("n", oss.str());
+//queues a request a draining worker handed back.  It goes first: it
+//was dispatched before anything that is queued now
+static void readmit(const Dispatched& d){
+  Queued_request q;
+  q.req = d.req;
+  q.cmd = d.cmd;
+  q.n = d.n;
+  admission_queues[work_class(d.cmd)].push_front(q);
 }
 
-void handle_client_request(Client_handle client_handle, const Request_msg& client_req) {
+//sends queued requests, highest priority class first, for as long as
+//some worker has a free slot for them
+static void dispatch_admitted(){
+  for(int p = 0; p < NUM_WORK_CLASSES; p++){
+    Work_class cls = class_priority[p];
+    std::deque<Queued_request>& queue = admission_queues[cls];
+    while(!queue.empty()){
+      Queued_request& q = queue.front();
+      int idx = choose_worker_idx(cls);
+      if(idx < 0){
+        break;
+      }
+      send_to_worker(idx, q.req, q.cmd, q.n, cost_model.estimate(q.cmd, q.n));
+      queue.pop_front();
+    }
+  }
+  hedge_stragglers();
+}
 
-  bool is_cache_intense = false; 
-  bool is_cpu_intense = false;
-  bool not_intense = false;
+// Generate an internal 'countprimesrange' request for [lo, hi)
+static void create_countprimesrange_req(Request_msg& req, int lo, int hi) {
+  std::ostringstream oss;
+  req.set_arg("cmd", "countprimesrange");
+  oss << lo;
+  req.set_arg("lo", oss.str());
+  oss.str("");
+  oss << hi;
+  req.set_arg("hi", oss.str());
+}
 
+//runs on the client's I/O thread, so it may only use the (thread-safe)
+//response cache.  The request's fingerprint is hashed here, off the
+//dispatcher, and handed on with the request
+bool try_answer_client_request(const Request_msg& client_req, Response_msg& resp,
+                               uint64_t& fingerprint) {
+  if (client_req.get_cmd() == CMD_LASTREQUEST) {
+    return false;
+  }
+  fingerprint = ResponseCache::fingerprint(client_req.get_request_string());
+  return req_cache.lookup(fingerprint, resp);
+}
 
-  int weighted_countprimes = 0;
+void handle_client_request(Client_handle client_handle, const Request_msg& client_req,
+                           uint64_t fingerprint) {
 
   DLOG(INFO) << "Received request: " << client_req.get_request_string() << std::endl;
 
   // You can assume that traces end with this special message.  It
   // exists because it might be useful for debugging to dump
   // information about the entire run here: statistics, etc.
-  if (client_req.get_arg("cmd") == "lastrequest") {
+  if (client_req.get_cmd() == CMD_LASTREQUEST) {
     Response_msg resp(0);
     resp.set_response("ack");
     send_client_response(client_handle, resp);
     mstate.last_req_seen = true;
+    LOG(INFO) << "Response cache: " << req_cache.stats();
+    LOG(INFO) << "Coalesced requests: " << mstate.num_coalesced_requests;
+    LOG(INFO) << "Hedged requests: " << mstate.num_hedged_requests
+              << " (" << mstate.num_hedges_won << " won by the copy)";
+    LOG(INFO) << "Requests returned by draining workers: "
+              << mstate.num_returned_requests;
+    LOG(INFO) << "Service times: " << cost_model;
     return;
   }
 
-  //Search for response in cache
-  std::string req_string = client_req.get_request_string();
-  if(req_cache.respMap.find(req_string) != req_cache.respMap.end()){
-    send_client_response(client_handle, req_cache.respMap.at(req_string));
+  //the cache was already searched by try_answer_client_request
+  std::string req_name = client_req.get_arg("cmd");
+
+  //an identical request is already at a worker, share its response
+  if(fingerprintToTagMap.find(fingerprint) != fingerprintToTagMap.end()){
+    int leader = fingerprintToTagMap.at(fingerprint);
+    tagToInFlightMap.at(leader).waiters.push_back(client_handle);
+    mstate.num_coalesced_requests++;
     return;
   }
-  tagToReqMap.insert(std::pair<int, std::string>(mstate.next_tag, req_string)); 
+  In_flight flight;
+  flight.fingerprint = fingerprint;
+  flight.cmd = req_name;
+  flight.cacheable = req_cache.admits(req_name);
+  tagToInFlightMap.insert(std::pair<int, In_flight>(mstate.next_tag, flight));
+  fingerprintToTagMap.insert(std::pair<uint64_t, int>(fingerprint, mstate.next_tag));
 
   mstate.num_pending_client_requests++;
 
   mstate.tagMap.insert(std::pair<int,Client_handle>(mstate.next_tag, client_handle));
   int tag = mstate.next_tag;
   
-  std::string req_name = client_req.get_arg("cmd");
-  //handle compareprimes by splitting into four countprimes requests
-  if(req_name == "compareprimes"){
-    tagToTypeMap.insert(std::pair<int,std::string>(tag, "cpu"));
-    int idx = choose_worker_idx(tag);
+  Request_cmd cmd = client_req.get_cmd();
 
+  //handle compareprimes by counting only the pieces of the number line
+  //where its two ranges differ (see compareprimes_ranges).  Each piece
+  //is placed on its own, so they fan out over the workers (a worker's
+  //backlog already includes the pieces placed before it)
+  if(cmd == CMD_COMPAREPRIMES){
     int parentTag = tag;
-    cmp_primes_data data;
-    data.num_received = 0;
-
-    mstate.worker_states[idx].num_cpu_intense_requests++;
-    mstate.worker_states[idx].num_pending_requests++;
+    Prime_range ranges[MAX_COMPAREPRIMES_RANGES];
+    int num_ranges = compareprimes_ranges(client_req.get_int_arg(ARG_N1),
+                                          client_req.get_int_arg(ARG_N2),
+                                          client_req.get_int_arg(ARG_N3),
+                                          client_req.get_int_arg(ARG_N4),
+                                          ranges);
+    mstate.next_tag += MAX_COMPAREPRIMES_RANGES;
+
+    //the ranges cancel out completely, nothing to count
+    if(num_ranges == 0){
+      finish_client_request(parentTag, compareprimes_response(parentTag, 0));
+      return;
+    }
 
+    cmp_primes_data data;
+    data.diff = 0;
+    data.num_remaining = num_ranges;
+
+    //queue the biggest pieces first so the small ones fill in around them
+    double estimates[MAX_COMPAREPRIMES_RANGES];
+    int order[MAX_COMPAREPRIMES_RANGES];
+    for(int i = 0; i < num_ranges; i++){
+      data.weights[i] = ranges[i].weight;
+      estimates[i] = cost_model.estimate(CMD_COUNTPRIMESRANGE, ranges[i].hi - ranges[i].lo);
+      order[i] = i;
+    }
     tagToCmpPrimesDataMap.insert(std::pair<int,cmp_primes_data>(parentTag, data));
-    int params[4];
-    params[0] = atoi(client_req.get_arg("n1").c_str());
-    params[1] = atoi(client_req.get_arg("n2").c_str());
-    params[2] = atoi(client_req.get_arg("n3").c_str());
-    params[3] = atoi(client_req.get_arg("n4").c_str());
+    for(int i = 1; i < num_ranges; i++){
+      for(int j = i; j > 0 && estimates[order[j]] > estimates[order[j - 1]]; j--){
+        std::swap(order[j], order[j - 1]);
+      }
+    }
     
-    for(int i = 0; i < 4; i++){
-      cmpPrimeTagToTagMap.insert(std::pair<int, int>(tag, parentTag));
-      Request_msg dummy_req(0);
-      create_computeprimes_req(dummy_req, params[i]);
-      Request_msg worker_cmpprimes_req(tag++, dummy_req);
-      mstate.next_tag++;
-      
-      Worker_state ws = mstate.worker_states[idx];
-      send_request_to_worker(ws.worker_handle, worker_cmpprimes_req);
+    for(int j = 0; j < num_ranges; j++){
+      int i = order[j];
+      int sub_tag = parentTag + i;
+      cmpPrimeTagToTagMap.insert(std::pair<int, int>(sub_tag, parentTag));
+      Request_msg range_req(sub_tag);
+      create_countprimesrange_req(range_req, ranges[i].lo, ranges[i].hi);
+      admit(range_req, CMD_COUNTPRIMESRANGE, ranges[i].hi - ranges[i].lo);
     }
-
+    dispatch_admitted();
     return;
   }
-  else if(req_name == "projectidea"){
-    tagToTypeMap.insert(std::pair<int,std::string>(tag, "cache"));
-    is_cache_intense = true;
-  } 
-  //we're going to fix this, but right now our map assumes everything maps
-  //to one of the three types of requests
-  else if(req_name == "tellmenow"){
-    tagToTypeMap.insert(std::pair<int,std::string>(tag, "non"));
-    not_intense = true;
-  }
-  //countprimes 418wisdm 
-  else{
-    if(req_name == "countprimes"){
-      int n = atoi(client_req.get_arg("n").c_str());
-      tagToPrimeMap.insert(std::pair<int,int>(tag, n));
-      weighted_countprimes = n;
-    }
-    tagToTypeMap.insert(std::pair<int,std::string>(tag, "cpu"));
-    is_cpu_intense = true;
+
+  int n = 0;
+  if(cmd == CMD_COUNTPRIMES){
+    n = client_req.get_int_arg(ARG_N);
   }
   
   Request_msg worker_req(tag, client_req);
-  int idx = choose_worker_idx(tag);
-  Worker_state ws = mstate.worker_states[idx];
+  mstate.next_tag++;
+  admit(worker_req, cmd, n);
+  dispatch_admitted();
+}
+
+void handle_worker_slots(Worker_handle worker_handle, int cpu_slots,
+                         int cache_slots, int light_slots) {
+  int idx = find_worker_idx(worker_handle);
+  if(idx >= 0){
+    Worker_state& ws = mstate.worker_states[idx];
+    ws.granted_slots[WORK_CPU] += cpu_slots;
+    ws.granted_slots[WORK_CACHE] += cache_slots;
+    ws.granted_slots[WORK_LIGHT] += light_slots;
+    update_worker_keys(idx);
+  }
+  dispatch_admitted();
+}
+
+//takes a request a draining worker handed back off its load.  In pull
+//mode its slot is free again: the worker only grants a slot back when
+//it answers a request
+static void retire_returned(const Dispatched& d){
+  if(FLAGS_pull_dispatch){
+    mstate.worker_states[d.worker_idx].granted_slots[work_class(d.cmd)]++;
+  }
+  retire(d, NULL);
+}
 
-  if(is_cache_intense){
-    mstate.worker_states[idx].num_cache_intense_requests++;
+void handle_worker_returned(Worker_handle worker_handle, int tag) {
+  int worker_idx = find_worker_idx(worker_handle);
+  if(worker_idx < 0){
+    LOG(WARNING) << "Dropping returned " << tag << " from an unknown worker";
+    return;
   }
-  else if(is_cpu_intense){
-    mstate.worker_states[idx].num_cpu_intense_requests++;
+
+  //the copy of a hedged request that lost, or that is still racing
+  //the original elsewhere: nothing to redo
+  if(tagToLateMap.find(tag) != tagToLateMap.end() &&
+     tagToLateMap.at(tag).worker_idx == worker_idx){
+    retire_returned(tagToLateMap.at(tag));
+    tagToLateMap.erase(tag);
   }
-  else if(not_intense){
-    mstate.worker_states[idx].num_non_intense_requests++;
+  else if(tagToHedgeMap.find(tag) != tagToHedgeMap.end() &&
+          tagToHedgeMap.at(tag).worker_idx == worker_idx){
+    retire_returned(tagToHedgeMap.at(tag));
+    tagToHedgeMap.erase(tag);
   }
-  mstate.worker_states[idx].weighted_countprimes_requests += weighted_countprimes;
-  mstate.worker_states[idx].num_pending_requests++;
-  mstate.next_tag++;
-  send_request_to_worker(ws.worker_handle, worker_req);
+  else{
+    Dispatched d = tagToDispatchedMap.at(tag);
+    tagToDispatchedMap.erase(tag);
+    retire_returned(d);
+    //a hedged copy elsewhere becomes the request, otherwise it has to
+    //be sent again
+    if(tagToHedgeMap.find(tag) != tagToHedgeMap.end()){
+      tagToDispatchedMap.insert(std::pair<int, Dispatched>(tag, tagToHedgeMap.at(tag)));
+      tagToHedgeMap.erase(tag);
+    }
+    else{
+      readmit(d);
+    }
+    mstate.num_returned_requests++;
+  }
+
+  kill_if_drained(worker_idx);
+  dispatch_admitted();
 }
 
-void handle_tick() {
-  int num_cpu = 0;
-  int num_cache = 0;
+void handle_worker_drained(Worker_handle worker_handle) {
+  int worker_idx = find_worker_idx(worker_handle);
+  if(worker_idx >= 0){
+    mstate.worker_states[worker_idx].draining = false;
+  }
+}
 
-  for(int i = 0; i < mstate.max_num_workers; i++){
-    Worker_state ws = mstate.worker_states[i];
+void handle_tick() {
+  hedge_stragglers();
+
+  //estimated seconds of work of each class queued in the master or
+  //running on the workers that are staying
+  double backlog[NUM_WORK_CLASSES];
+  for(int c = 0; c < NUM_WORK_CLASSES; c++){
+    backlog[c] = 0;
+    for(size_t i = 0; i < admission_queues[c].size(); i++){
+      const Queued_request& q = admission_queues[c][i];
+      backlog[c] += cost_model.estimate(q.cmd, q.n);
+    }
+  }
+  for(size_t i = 0; i < mstate.worker_states.size(); i++){
+    Worker_state& ws = mstate.worker_states[i];
     if(ws.is_alive && !ws.to_be_killed){
-      num_cpu += ws.num_cpu_intense_requests;
-      num_cache += ws.num_cache_intense_requests;
+      for(int c = 0; c < NUM_WORK_CLASSES; c++){
+        backlog[c] += ws.est_seconds[c];
+      }
     }
-  }  
-  // fast requests like tellmenow are unweighted
-  int weighted_total = num_cpu + 3 * num_cache;
+  }
 
   int num_actually_alive = mstate.num_alive_workers - mstate.num_to_be_killed;
-  //policy to add more worker nodes
-  if(num_actually_alive < mstate.max_num_workers){
-    int avg_cpu_intense_work = num_cpu / num_actually_alive;
-    int avg_cache_intense_work = num_cache / num_actually_alive;
-
-    if(avg_cpu_intense_work > 3 * MAX_THREADS / 4  || avg_cache_intense_work > 1){
-      if(mstate.num_to_be_killed == 0 && mstate.num_alive_workers < mstate.max_num_workers){
-        int tag = random();
-        Request_msg req(tag);
-        req.set_arg("name", "my worker 0");
-        request_new_worker_node(req);
-      }
-      else{
-        for(int i = 0; i < mstate.max_num_workers; i++){
-          Worker_state ws = mstate.worker_states[i];
-          if(ws.is_alive && ws.to_be_killed){
-            mstate.worker_states[i].to_be_killed = false;
-            mstate.num_to_be_killed--;
-            num_actually_alive++;
-            break;
-          }
-        }
+  int decision = autoscaler.decide(CycleTimer::currentSeconds(), num_actually_alive,
+                                   mstate.num_booting, backlog);
+  if(decision > 0){
+    //a worker that is being drained is back quicker than a new one,
+    //once everything it is handing back has arrived
+    for(size_t i = 0; i < mstate.worker_states.size(); i++){
+      Worker_state& ws = mstate.worker_states[i];
+      if(ws.is_alive && ws.to_be_killed && !ws.draining){
+        ws.to_be_killed = false;
+        mstate.num_to_be_killed--;
+        update_worker_keys(i);
+        dispatch_admitted();
+        return;
       }
-      return; //don't check kill if we've added
     }
-  }
-
-  //policy to remove worker nodes only if there are more than one nodes
-  if(num_actually_alive > 1){
-    //what's the average work per node if you did take away a worker
-    int avg_cpu_intense_work = num_cpu / (num_actually_alive - 1);
-    int avg_cache_intense_work = num_cache / (num_actually_alive - 1);
-    //we have 1 thread dedicated to tellmenow and one to projectidea which leaves
-    //MAX_THREADS - 2 threads for the other requests
-    if(avg_cpu_intense_work < MAX_THREADS - 2 && avg_cache_intense_work < 1){
-      int idx = find_min_load_idx();
-      mstate.worker_states[idx].to_be_killed = true;
-      mstate.num_to_be_killed++;
+    if(mstate.num_alive_workers + mstate.num_booting < mstate.max_num_workers){
+      DLOG(INFO) << "Adding a worker: " << autoscaler << std::endl;
+      launch_worker();
     }
   }
+  else if(decision < 0 && num_actually_alive > 1){
+    //its queued requests come back to be sent elsewhere, and it goes
+    //as soon as the ones it is running are done
+    DLOG(INFO) << "Retiring a worker: " << autoscaler << std::endl;
+    int idx = find_min_load_idx();
+    mstate.worker_states[idx].to_be_killed = true;
+    mstate.worker_states[idx].draining = true;
+    mstate.num_to_be_killed++;
+    update_worker_keys(idx);
+    drain_worker_node(mstate.worker_states[idx].worker_handle);
+    kill_if_drained(idx);
+  }
 }
@@ -0,0 +1,375 @@
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "prime_index.h"
+
+#define PRIME_INDEX_MAGIC "PRIMEIDX"
+#define PRIME_INDEX_VERSION 1
+
+// on-disk layout: this header, then num_words bitset words, then
+// num_words prefix counts
+struct Prime_index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  int64_t limit;
+  uint64_t num_words;
+};
+
+// A larger index being built.  Each segment task fills in its own
+// words of 'bits'; the last one to finish swaps the index in.
+struct PrimeIndex::Build {
+  int64_t limit;
+  int64_t num_odds;
+  std::vector<uint64_t> bits;
+  std::vector<int> base_primes;  // the odd primes up to sqrt(limit)
+  std::atomic<int> num_remaining;
+};
+
+PrimeIndex::PrimeIndex() {
+  pthread_rwlock_init(&lock, NULL);
+  pthread_mutex_init(&grow_lock, NULL);
+  growing = false;
+  wanted = 0;
+  start = [](Task task) { task(); };
+  limit = 0;
+  bits = NULL;
+  prefix = NULL;
+  num_words = 0;
+  mapping = NULL;
+  mapping_size = 0;
+}
+
+PrimeIndex::~PrimeIndex() {
+  unmap();
+  pthread_mutex_destroy(&grow_lock);
+  pthread_rwlock_destroy(&lock);
+}
+
+void PrimeIndex::init(const std::string& arg_path,
+                      std::function<void(Task)> arg_start) {
+  pthread_rwlock_wrlock(&lock);
+  path = arg_path;
+  start = arg_start;
+  if (!path.empty() && load()) {
+    DLOG(INFO) << "Loaded prime index up to " << limit << " from " << path;
+  }
+  pthread_rwlock_unlock(&lock);
+}
+
+void PrimeIndex::unmap() {
+  if (mapping) {
+    munmap(mapping, mapping_size);
+    mapping = NULL;
+    mapping_size = 0;
+  }
+}
+
+/*
+ * lookup --
+ *
+ * pi(n) for 0 <= n < limit.  Caller holds the lock.
+ */
+int PrimeIndex::lookup(int64_t n) const {
+  if (n < 2) {
+    return 0;
+  }
+  // 2 plus the odd primes 2j+1 <= n, i.e. bits [0, j]
+  int64_t j = (n - 1) / 2;
+  size_t word = j / 64;
+  int bit = j % 64;
+  uint64_t mask = (bit == 63) ? ~0ULL : ((1ULL << (bit + 1)) - 1);
+  return 1 + prefix[word] + __builtin_popcountll(bits[word] & mask);
+}
+
+/*
+ * request_growth --
+ *
+ * Starts building an index that covers n, unless one is being built
+ * already; n is then covered by the build after it.
+ */
+void PrimeIndex::request_growth(int64_t n) {
+  pthread_mutex_lock(&grow_lock);
+  if (n > wanted) {
+    wanted = n;
+  }
+  int64_t current = bound();
+  if (growing || wanted < current) {
+    pthread_mutex_unlock(&grow_lock);
+    return;
+  }
+  growing = true;
+  int64_t new_limit = 2 * current;
+  if (new_limit < PRIME_INDEX_MIN) {
+    new_limit = PRIME_INDEX_MIN;
+  }
+  if (new_limit <= wanted) {
+    new_limit = wanted + 1;
+  }
+  if (new_limit > PRIME_INDEX_MAX) {
+    new_limit = PRIME_INDEX_MAX;
+  }
+  pthread_mutex_unlock(&grow_lock);
+
+  DLOG(INFO) << "Growing prime index to " << new_limit;
+  start([this, new_limit]() { start_build(new_limit); });
+}
+
+/*
+ * start_build --
+ *
+ * Sieves the base primes, which every segment needs, and hands the
+ * segments of the new index out as separate tasks.
+ */
+void PrimeIndex::start_build(int64_t new_limit) {
+  std::shared_ptr<Build> build = std::make_shared<Build>();
+  build->limit = new_limit;
+  // one bit per odd number below new_limit
+  build->num_odds = new_limit / 2;
+  size_t words = (build->num_odds + 63) / 64;
+  build->bits.resize(words);
+
+  int root = 1;
+  while ((int64_t)root * root < new_limit) {
+    root++;
+  }
+  std::vector<char> composite(root + 1, 0);
+  for (int p = 3; p <= root; p += 2) {
+    if (composite[p]) {
+      continue;
+    }
+    build->base_primes.push_back(p);
+    for (int m = p * p; m <= root; m += 2 * p) {
+      composite[m] = 1;
+    }
+  }
+
+  const size_t segment_words = PRIME_INDEX_SEGMENT_ODDS / 64;
+  int num_segments = (words + segment_words - 1) / segment_words;
+  build->num_remaining.store(num_segments);
+  for (int i = 0; i < num_segments; i++) {
+    size_t first_word = i * segment_words;
+    size_t end_word = std::min(words, first_word + segment_words);
+    start([this, build, first_word, end_word]() {
+      sieve_segment(build.get(), first_word, end_word);
+      if (build->num_remaining.fetch_sub(1) == 1) {
+        finish_build(build);
+      }
+    });
+  }
+}
+
+// Fills in bits [first_word, end_word) of the build: bit j stands for
+// the odd number 2j+1.
+void PrimeIndex::sieve_segment(Build* build, size_t first_word, size_t end_word) {
+  uint64_t* bits = build->bits.data();
+  for (size_t w = first_word; w < end_word; w++) {
+    bits[w] = ~0ULL;
+  }
+  if (first_word == 0) {
+    bits[0] &= ~1ULL; // 1 is not prime
+  }
+  int64_t first_odd = first_word * 64;
+  int64_t end_odd = std::min<int64_t>(end_word * 64, build->num_odds);
+  if (end_odd % 64) {
+    bits[end_word - 1] &= (1ULL << (end_odd % 64)) - 1;
+  }
+
+  int64_t lo = 2 * first_odd + 1;
+  int64_t hi = 2 * end_odd;
+  for (size_t i = 0; i < build->base_primes.size(); i++) {
+    int64_t p = build->base_primes[i];
+    if (p * p >= hi) {
+      break;
+    }
+    // the first odd multiple of p in the segment, from p*p on
+    int64_t m = std::max(p * p, (lo + p - 1) / p * p);
+    if (m % 2 == 0) {
+      m += p;
+    }
+    for (; m < hi; m += 2 * p) {
+      int64_t jm = m / 2;
+      bits[jm / 64] &= ~(1ULL << (jm % 64));
+    }
+  }
+}
+
+/*
+ * finish_build --
+ *
+ * Counts the prefixes, swaps the new index in (the only part done
+ * under the write lock) and saves it.  Then starts the next build if
+ * a query wanted more meanwhile.
+ */
+void PrimeIndex::finish_build(const std::shared_ptr<Build>& build) {
+  size_t words = build->bits.size();
+  std::vector<uint32_t> new_prefix(words);
+  uint32_t running = 0;
+  for (size_t w = 0; w < words; w++) {
+    new_prefix[w] = running;
+    running += __builtin_popcountll(build->bits[w]);
+  }
+
+  pthread_rwlock_wrlock(&lock);
+  unmap();
+  bits_storage.swap(build->bits);
+  prefix_storage.swap(new_prefix);
+  bits = bits_storage.data();
+  prefix = prefix_storage.data();
+  num_words = words;
+  limit = build->limit;
+  pthread_rwlock_unlock(&lock);
+
+  DLOG(INFO) << "Prime index grown to " << build->limit;
+  // the index only changes again in the next build, which can't start
+  // before this one is marked done
+  if (!path.empty()) {
+    save();
+  }
+
+  pthread_mutex_lock(&grow_lock);
+  growing = false;
+  int64_t more = wanted;
+  pthread_mutex_unlock(&grow_lock);
+  if (more >= build->limit && build->limit < PRIME_INDEX_MAX) {
+    request_growth(more);
+  }
+}
+
+/*
+ * load --
+ *
+ * Maps the index file.  The index then points straight into the
+ * mapping, so loading costs no more than the page faults of the words
+ * actually queried.
+ */
+bool PrimeIndex::load() {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Prime_index_header)) {
+    close(fd);
+    return false;
+  }
+
+  void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    return false;
+  }
+
+  const Prime_index_header* header = static_cast<const Prime_index_header*>(mem);
+  uint64_t words = header->num_words;
+  bool valid = memcmp(header->magic, PRIME_INDEX_MAGIC, 8) == 0 &&
+    header->version == PRIME_INDEX_VERSION &&
+    header->limit > 0 && header->limit <= PRIME_INDEX_MAX &&
+    words == (uint64_t)(header->limit / 2 + 63) / 64 &&
+    (size_t)st.st_size == sizeof(*header) + words * (sizeof(uint64_t) + sizeof(uint32_t));
+  if (!valid || header->limit <= limit) {
+    LOG_IF(WARNING, !valid) << "Ignoring invalid prime index file " << path;
+    munmap(mem, st.st_size);
+    return false;
+  }
+
+  unmap();
+  mapping = mem;
+  mapping_size = st.st_size;
+  const char* base = static_cast<const char*>(mem) + sizeof(*header);
+  bits = reinterpret_cast<const uint64_t*>(base);
+  prefix = reinterpret_cast<const uint32_t*>(base + words * sizeof(uint64_t));
+  num_words = words;
+  limit = header->limit;
+  bits_storage.clear();
+  prefix_storage.clear();
+  return true;
+}
+
+/*
+ * save --
+ *
+ * Writes the index next to 'path' and renames it into place, so
+ * readers (and other workers sharing the file) never see a partial
+ * index.
+ */
+void PrimeIndex::save() {
+  char suffix[32];
+  sprintf(suffix, ".tmp.%d", (int)getpid());
+  std::string tmp_path = path + suffix;
+
+  FILE* f = fopen(tmp_path.c_str(), "wb");
+  if (!f) {
+    PLOG(WARNING) << "Cannot write prime index " << tmp_path;
+    return;
+  }
+
+  Prime_index_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PRIME_INDEX_MAGIC, 8);
+  header.version = PRIME_INDEX_VERSION;
+  header.limit = limit;
+  header.num_words = num_words;
+
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+    fwrite(bits, sizeof(uint64_t), num_words, f) == num_words &&
+    fwrite(prefix, sizeof(uint32_t), num_words, f) == num_words;
+  ok = (fclose(f) == 0) && ok;
+
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) < 0) {
+    PLOG(WARNING) << "Cannot save prime index to " << path;
+    unlink(tmp_path.c_str());
+  }
+}
+
+int PrimeIndex::pi(int n) {
+  if (n < 2) {
+    return 0;
+  }
+  if (n >= PRIME_INDEX_MAX) {
+    return -1;
+  }
+
+  // a build only runs before this returns if 'start' runs tasks
+  // right away, so look again after asking for one
+  for (int attempt = 0; attempt < 2; attempt++) {
+    pthread_rwlock_rdlock(&lock);
+    if (n < limit) {
+      int count = lookup(n);
+      pthread_rwlock_unlock(&lock);
+      return count;
+    }
+    pthread_rwlock_unlock(&lock);
+    if (attempt == 0) {
+      request_growth(n);
+    }
+  }
+  return -1;
+}
+
+int PrimeIndex::count_in_range(int lo, int hi) {
+  if (hi <= lo || hi <= 2) {
+    return 0;
+  }
+  int below_hi = pi(hi - 1);
+  if (below_hi < 0) {
+    return -1;
+  }
+  return below_hi - ((lo > 2) ? pi(lo - 1) : 0);
+}
+
+int64_t PrimeIndex::bound() {
+  pthread_rwlock_rdlock(&lock);
+  int64_t b = limit;
+  pthread_rwlock_unlock(&lock);
+  return b;
+}
@@ -0,0 +1,93 @@
+#ifndef __MYSERVER_PRIME_INDEX_H__
+#define __MYSERVER_PRIME_INDEX_H__
+
+#include <functional>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// the index never grows past this bound (a 16 MB bitset); larger
+// queries return -1 and callers fall back to sieving
+#define PRIME_INDEX_MAX (1 << 28)
+// size of the first sieve, so small queries don't regrow repeatedly
+#define PRIME_INDEX_MIN (1 << 20)
+// odd numbers sieved by each task of a build: 128 KB of flag bits,
+// about the size of L2
+#define PRIME_INDEX_SEGMENT_ODDS (1 << 20)
+
+/*
+ * PrimeIndex --
+ *
+ * Answers pi(n) (the number of primes <= n) in O(1) for every n below
+ * a bound.  The index is a bitset over the odd numbers plus, for each
+ * 64-bit word, the number of odd primes in the words before it, so a
+ * query is one prefix lookup and one popcount.
+ *
+ * The bound starts at zero and grows (at least doubling) the first
+ * time a larger n is asked for.  The larger index is built in the
+ * background, as segmented sieve tasks handed to 'start' (e.g. the
+ * worker's pool), and swapped in when it is complete; queries never
+ * wait for it, they get -1 until it covers them and the caller counts
+ * some other way meanwhile.  If a file is given, the index is mmapped
+ * from it at startup and rewritten after every growth, so a restarted
+ * worker begins with the largest index any earlier worker built.
+ * Queries may come from any thread.
+ */
+class PrimeIndex {
+public:
+  typedef std::function<void()> Task;
+
+  PrimeIndex();
+  ~PrimeIndex();
+
+  // Sets the backing file ("" for none) and loads it if it holds a
+  // valid index.  Builds run their tasks through 'start'.
+  void init(const std::string& path, std::function<void(Task)> start);
+
+  // Number of primes <= n, or -1 if the index doesn't cover n (yet, or
+  // ever if n >= PRIME_INDEX_MAX).
+  int pi(int n);
+
+  // Number of primes p with lo <= p < hi, or -1 if the index doesn't
+  // cover hi.
+  int count_in_range(int lo, int hi);
+
+  // Every n < bound() is answered without growing.
+  int64_t bound();
+
+private:
+  struct Build;
+
+  pthread_rwlock_t lock;
+  std::string path;
+  std::function<void(Task)> start;
+
+  // a build is running; wanted is the largest n asked for meanwhile
+  pthread_mutex_t grow_lock;
+  bool growing;
+  int64_t wanted;
+
+  int64_t limit;
+  // bit j of the index is set iff 2j+1 is prime
+  const uint64_t* bits;
+  const uint32_t* prefix;
+  size_t num_words;
+
+  std::vector<uint64_t> bits_storage;
+  std::vector<uint32_t> prefix_storage;
+  void* mapping;
+  size_t mapping_size;
+
+  int lookup(int64_t n) const;
+  void request_growth(int64_t n);
+  void start_build(int64_t new_limit);
+  void sieve_segment(Build* build, size_t first_word, size_t end_word);
+  void finish_build(const std::shared_ptr<Build>& build);
+  void unmap();
+  bool load();
+  void save();
+};
+
+#endif  // __MYSERVER_PRIME_INDEX_H__
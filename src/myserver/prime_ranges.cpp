@@ -0,0 +1,51 @@
+#include <algorithm>
+
+#include "prime_ranges.h"
+
+int countprimes_bound(int n) {
+  if (n < 2) {
+    return 2;  // empty
+  }
+  return (n > 3) ? n : 3;
+}
+
+int compareprimes_ranges(int n1, int n2, int n3, int n4, Prime_range* ranges) {
+  // each signed difference of prefix counts as an interval with a
+  // sign; the second one is subtracted
+  int lo[2], hi[2], weight[2];
+  int bounds[4] = {countprimes_bound(n1), countprimes_bound(n2),
+                   countprimes_bound(n3), countprimes_bound(n4)};
+  for (int i = 0; i < 2; i++) {
+    int a = bounds[2 * i];
+    int b = bounds[2 * i + 1];
+    int sign = (i == 0) ? 1 : -1;
+    lo[i] = std::min(a, b);
+    hi[i] = std::max(a, b);
+    weight[i] = (b >= a) ? sign : -sign;
+  }
+
+  // cut the line at every endpoint and weigh each piece by the
+  // intervals covering it
+  int points[4] = {lo[0], hi[0], lo[1], hi[1]};
+  std::sort(points, points + 4);
+
+  int num_ranges = 0;
+  for (int i = 0; i < 3; i++) {
+    if (points[i] == points[i + 1]) {
+      continue;
+    }
+    int w = 0;
+    for (int j = 0; j < 2; j++) {
+      if (lo[j] <= points[i] && points[i + 1] <= hi[j]) {
+        w += weight[j];
+      }
+    }
+    if (w != 0) {
+      ranges[num_ranges].lo = points[i];
+      ranges[num_ranges].hi = points[i + 1];
+      ranges[num_ranges].weight = w;
+      num_ranges++;
+    }
+  }
+  return num_ranges;
+}
@@ -0,0 +1,33 @@
+#ifndef __MYSERVER_PRIME_RANGES_H__
+#define __MYSERVER_PRIME_RANGES_H__
+
+// at most this many pieces come out of compareprimes_ranges
+#define MAX_COMPAREPRIMES_RANGES 3
+
+// countprimes(n) answers the number of primes p with
+// 2 <= p < countprimes_bound(n)
+int countprimes_bound(int n);
+
+// primes in [lo, hi), counted 'weight' times
+struct Prime_range {
+  int lo;
+  int hi;
+  int weight;
+};
+
+/*
+ * compareprimes_ranges --
+ *
+ * compareprimes(n1, n2, n3, n4) answers "first range" exactly when
+ *
+ *   (countprimes(n2) - countprimes(n1)) - (countprimes(n4) - countprimes(n3)) > 0
+ *
+ * Fills 'ranges' with disjoint pieces of the number line such that
+ * this difference is the sum of weight * (primes in [lo, hi)) over
+ * them, and returns how many there are.  Only the two ranges are
+ * covered, never the prefixes below them, and a part both ranges
+ * share cancels out and is left out entirely.
+ */
+int compareprimes_ranges(int n1, int n2, int n3, int n4, Prime_range* ranges);
+
+#endif  // __MYSERVER_PRIME_RANGES_H__
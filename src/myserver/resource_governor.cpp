@@ -0,0 +1,130 @@
+#include <vector>
+
+#include "resource_governor.h"
+
+Resource_class resource_class(Request_cmd cmd) {
+  switch (cmd) {
+  case CMD_PROJECTIDEA:
+    return RES_LLC;
+  case CMD_BANDWIDTH:
+    return RES_BANDWIDTH;
+  default:
+    return RES_CPU;
+  }
+}
+
+ResourceGovernor::ResourceGovernor() {
+  pthread_mutex_init(&lock, NULL);
+  for (int i = 0; i < NUM_RESOURCE_CLASSES; i++) {
+    limits[i] = -1;
+    running[i] = 0;
+    for (int j = 0; j < NUM_RESOURCE_CLASSES; j++) {
+      exclusive[i][j] = false;
+    }
+  }
+  next_class = 0;
+}
+
+ResourceGovernor::~ResourceGovernor() {
+  pthread_mutex_destroy(&lock);
+}
+
+void ResourceGovernor::init(std::function<void(Task)> arg_start) {
+  start = arg_start;
+}
+
+void ResourceGovernor::set_limit(Resource_class cls, int max_running) {
+  limits[cls] = max_running;
+}
+
+void ResourceGovernor::set_exclusive(Resource_class a, Resource_class b) {
+  exclusive[a][b] = true;
+  exclusive[b][a] = true;
+}
+
+// Called with the lock held.  'ahead' is how many classes, counting
+// round from 'first', are served before cls: one of them that excludes
+// cls and has jobs waiting goes first, or a steady stream of cls jobs
+// would keep it out for good.
+bool ResourceGovernor::can_start(Resource_class cls, int first, int ahead) const {
+  if (limits[cls] >= 0 && running[cls] >= limits[cls]) {
+    return false;
+  }
+  for (int other = 0; other < NUM_RESOURCE_CLASSES; other++) {
+    if (!exclusive[cls][other]) {
+      continue;
+    }
+    if (running[other] > 0) {
+      return false;
+    }
+    int turn = (other - first + NUM_RESOURCE_CLASSES) % NUM_RESOURCE_CLASSES;
+    if (!waiting[other].empty() && turn < ahead) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// hands the task to 'start', wrapped so it frees its slot when done
+void ResourceGovernor::launch(Resource_class cls, Task task) {
+  start([this, cls, task]() {
+    task();
+    release(cls);
+  });
+}
+
+// a class with no limit that excludes nothing never has to wait
+bool ResourceGovernor::is_governed(Resource_class cls) const {
+  if (limits[cls] >= 0) {
+    return true;
+  }
+  for (int other = 0; other < NUM_RESOURCE_CLASSES; other++) {
+    if (exclusive[cls][other]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ResourceGovernor::submit(Resource_class cls, Task task) {
+  if (!is_governed(cls)) {
+    start(task);
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  // don't overtake jobs of the class, or of a class it excludes, that
+  // are already waiting
+  if (!waiting[cls].empty() ||
+      !can_start(cls, next_class, NUM_RESOURCE_CLASSES)) {
+    waiting[cls].push_back(task);
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  running[cls]++;
+  pthread_mutex_unlock(&lock);
+  launch(cls, task);
+}
+
+void ResourceGovernor::release(Resource_class cls) {
+  std::vector<std::pair<Resource_class, Task> > ready;
+
+  pthread_mutex_lock(&lock);
+  running[cls]--;
+  // start whatever now fits, taking the classes in turn from
+  // next_class so none of them can be kept out for good
+  int first = next_class;
+  for (int i = 0; i < NUM_RESOURCE_CLASSES; i++) {
+    Resource_class c = (Resource_class)((first + i) % NUM_RESOURCE_CLASSES);
+    while (!waiting[c].empty() && can_start(c, first, i)) {
+      running[c]++;
+      ready.push_back(std::make_pair(c, waiting[c].front()));
+      waiting[c].pop_front();
+      next_class = (c + 1) % NUM_RESOURCE_CLASSES;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  for (size_t i = 0; i < ready.size(); i++) {
+    launch(ready[i].first, ready[i].second);
+  }
+}
@@ -0,0 +1,67 @@
+#ifndef __MYSERVER_RESOURCE_GOVERNOR_H__
+#define __MYSERVER_RESOURCE_GOVERNOR_H__
+
+#include <deque>
+#include <functional>
+#include <pthread.h>
+
+#include "server/messages.h"
+
+// The shared node resource a job leans on (see the job comments in
+// work_engine.cpp).
+enum Resource_class {
+  RES_CPU,        // ALU bound, tiny working set: 418wisdom, countprimes
+  RES_LLC,        // needs most of the last level cache: projectidea
+  RES_BANDWIDTH,  // streams memory: bandwidth
+  NUM_RESOURCE_CLASSES
+};
+
+Resource_class resource_class(Request_cmd cmd);
+
+/*
+ * ResourceGovernor --
+ *
+ * Limits how many jobs of each resource class run on the node at once,
+ * and keeps classes that would spoil each other apart, so the node
+ * mixes complementary jobs (e.g. ALU work next to a cache resident
+ * job) instead of several jobs fighting over one resource.  A job
+ * that can't start waits in its class's queue without holding a
+ * thread; it is handed to 'start' (which runs it, e.g. on the pool)
+ * once a job that was in its way finishes.  Waiting classes are
+ * served in turn, and a class doesn't start new jobs while one it
+ * excludes is waiting, so two classes that exclude each other both get
+ * to run.  Limits are set up before the first submit.
+ */
+class ResourceGovernor {
+public:
+  typedef std::function<void()> Task;
+
+  ResourceGovernor();
+  ~ResourceGovernor();
+
+  void init(std::function<void(Task)> start);
+  // at most max_running jobs of the class at once; -1 for no limit
+  void set_limit(Resource_class cls, int max_running);
+  // jobs of classes a and b never run at the same time
+  void set_exclusive(Resource_class a, Resource_class b);
+
+  // Runs 'task' through 'start' as soon as its class allows.  The slot
+  // is freed when the task returns.
+  void submit(Resource_class cls, Task task);
+
+private:
+  pthread_mutex_t lock;
+  std::function<void(Task)> start;
+  int limits[NUM_RESOURCE_CLASSES];
+  int running[NUM_RESOURCE_CLASSES];
+  bool exclusive[NUM_RESOURCE_CLASSES][NUM_RESOURCE_CLASSES];
+  std::deque<Task> waiting[NUM_RESOURCE_CLASSES];
+  int next_class;  // the waiting class served first on the next release
+
+  bool is_governed(Resource_class cls) const;
+  bool can_start(Resource_class cls, int first, int ahead) const;
+  void launch(Resource_class cls, Task task);
+  void release(Resource_class cls);
+};
+
+#endif  // __MYSERVER_RESOURCE_GOVERNOR_H__
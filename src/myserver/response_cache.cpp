@@ -0,0 +1,223 @@
+#include <string.h>
+
+#include "response_cache.h"
+#include "tools/cycle_timer.h"
+
+// rough per-entry cost of the list node and hash index beyond the
+// Entry itself, so the byte budget tracks real memory use
+#define CACHE_ENTRY_OVERHEAD 64
+
+std::ostream& operator<< (std::ostream& out, const Cache_stats& stats) {
+  uint64_t lookups = stats.hits + stats.misses;
+  return out << "Cache(hits=" << stats.hits
+             << ", misses=" << stats.misses
+             << ", hit_rate=" << (lookups ? 100.0 * stats.hits / lookups : 0.0) << "%"
+             << ", insertions=" << stats.insertions
+             << ", evictions=" << stats.evictions
+             << ", expirations=" << stats.expirations
+             << ", rejections=" << stats.rejections
+             << ", entries=" << stats.entries
+             << ", bytes=" << stats.bytes << "/" << stats.capacity_bytes << ")";
+}
+
+ResponseCache::ResponseCache(size_t arg_capacity_bytes, int num_shards,
+                             Cache_policy arg_policy) {
+  policy = arg_policy;
+  capacity_bytes = arg_capacity_bytes;
+  if (num_shards < 1) {
+    num_shards = 1;
+  }
+  for (int i = 0; i < num_shards; i++) {
+    Shard* shard = new Shard();
+    pthread_mutex_init(&shard->lock, NULL);
+    shard->hand = shard->entries.end();
+    shard->bytes = 0;
+    shard->capacity = capacity_bytes / num_shards;
+    memset(&shard->stats, 0, sizeof(shard->stats));
+    shards.push_back(shard);
+  }
+}
+
+void ResponseCache::set_policy(Cache_policy arg_policy) {
+  policy = arg_policy;
+}
+
+ResponseCache::~ResponseCache() {
+  for (size_t i = 0; i < shards.size(); i++) {
+    pthread_mutex_destroy(&shards[i]->lock);
+    delete shards[i];
+  }
+}
+
+/*
+ * fingerprint --
+ *
+ * 64-bit FNV-1a of the request string, followed by a final avalanche
+ * so that the high bits (used to pick a shard) depend on every byte.
+ */
+uint64_t ResponseCache::fingerprint(const std::string& request_string) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < request_string.size(); i++) {
+    h ^= (unsigned char)request_string[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Rules are meant to be set up before the cache is shared between
+// threads.
+void ResponseCache::set_rule(const std::string& cmd, bool admit,
+                             double ttl_seconds) {
+  Rule rule;
+  rule.admit = admit;
+  rule.ttl_seconds = ttl_seconds;
+  rules[cmd] = rule;
+}
+
+bool ResponseCache::admits(const std::string& cmd) const {
+  std::map<std::string, Rule>::const_iterator it = rules.find(cmd);
+  return it == rules.end() || it->second.admit;
+}
+
+void ResponseCache::erase(Shard* shard, std::list<Entry>::iterator it) {
+  if (shard->hand == it) {
+    ++shard->hand;
+  }
+  shard->bytes -= it->bytes;
+  shard->index.erase(it->key);
+  shard->entries.erase(it);
+}
+
+void ResponseCache::evict_one(Shard* shard) {
+  if (policy == CACHE_LRU) {
+    erase(shard, --shard->entries.end());
+  }
+  else {
+    // CLOCK: referenced entries get a second chance
+    while (1) {
+      if (shard->hand == shard->entries.end()) {
+        shard->hand = shard->entries.begin();
+      }
+      if (!shard->hand->referenced) {
+        break;
+      }
+      shard->hand->referenced = false;
+      ++shard->hand;
+    }
+    erase(shard, shard->hand);
+  }
+  shard->stats.evictions++;
+}
+
+bool ResponseCache::lookup(uint64_t key, Response_msg& resp) {
+  Shard* shard = shard_for(key);
+  bool hit = false;
+
+  pthread_mutex_lock(&shard->lock);
+  std::unordered_map<uint64_t, std::list<Entry>::iterator>::iterator found =
+    shard->index.find(key);
+  if (found != shard->index.end()) {
+    std::list<Entry>::iterator it = found->second;
+    if (it->expires_at > 0 && CycleTimer::currentSeconds() > it->expires_at) {
+      erase(shard, it);
+      shard->stats.expirations++;
+    }
+    else {
+      if (policy == CACHE_LRU) {
+        shard->entries.splice(shard->entries.begin(), shard->entries, it);
+      }
+      else {
+        it->referenced = true;
+      }
+      resp = it->resp;
+      hit = true;
+    }
+  }
+  if (hit) {
+    shard->stats.hits++;
+  }
+  else {
+    shard->stats.misses++;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  return hit;
+}
+
+void ResponseCache::insert(uint64_t key, const std::string& cmd,
+                           const Response_msg& resp) {
+  Shard* shard = shard_for(key);
+
+  Rule rule;
+  rule.admit = true;
+  rule.ttl_seconds = 0;
+  std::map<std::string, Rule>::const_iterator r = rules.find(cmd);
+  if (r != rules.end()) {
+    rule = r->second;
+  }
+
+  Entry entry;
+  entry.key = key;
+  entry.resp = resp;
+  entry.expires_at = (rule.ttl_seconds > 0) ?
+    CycleTimer::currentSeconds() + rule.ttl_seconds : 0;
+  entry.bytes = sizeof(Entry) + resp.get_response().size() + CACHE_ENTRY_OVERHEAD;
+  // a new entry starts referenced so the sweep that makes room for
+  // it can't pick it first
+  entry.referenced = true;
+
+  pthread_mutex_lock(&shard->lock);
+  if (!rule.admit || entry.bytes > shard->capacity) {
+    shard->stats.rejections++;
+    pthread_mutex_unlock(&shard->lock);
+    return;
+  }
+
+  std::unordered_map<uint64_t, std::list<Entry>::iterator>::iterator found =
+    shard->index.find(key);
+  if (found != shard->index.end()) {
+    erase(shard, found->second);
+  }
+
+  std::list<Entry>::iterator it;
+  if (policy == CACHE_LRU) {
+    it = shard->entries.insert(shard->entries.begin(), entry);
+  }
+  else {
+    // just behind the hand, i.e. the last entry the next sweep visits
+    it = shard->entries.insert(shard->hand, entry);
+  }
+  shard->index[key] = it;
+  shard->bytes += entry.bytes;
+  shard->stats.insertions++;
+
+  while (shard->bytes > shard->capacity) {
+    evict_one(shard);
+  }
+  pthread_mutex_unlock(&shard->lock);
+}
+
+Cache_stats ResponseCache::stats() {
+  Cache_stats total;
+  memset(&total, 0, sizeof(total));
+  for (size_t i = 0; i < shards.size(); i++) {
+    Shard* shard = shards[i];
+    pthread_mutex_lock(&shard->lock);
+    total.hits += shard->stats.hits;
+    total.misses += shard->stats.misses;
+    total.insertions += shard->stats.insertions;
+    total.evictions += shard->stats.evictions;
+    total.expirations += shard->stats.expirations;
+    total.rejections += shard->stats.rejections;
+    total.entries += shard->entries.size();
+    total.bytes += shard->bytes;
+    pthread_mutex_unlock(&shard->lock);
+  }
+  total.capacity_bytes = capacity_bytes;
+  return total;
+}
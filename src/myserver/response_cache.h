@@ -0,0 +1,103 @@
+#ifndef __MYSERVER_RESPONSE_CACHE_H__
+#define __MYSERVER_RESPONSE_CACHE_H__
+
+#include <iostream>
+#include <list>
+#include <map>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "server/messages.h"
+
+enum Cache_policy {
+  CACHE_LRU,   // evict the least recently used entry
+  CACHE_CLOCK  // second-chance approximation of LRU; hits don't relink
+};
+
+struct Cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t insertions;
+  uint64_t evictions;
+  uint64_t expirations;
+  uint64_t rejections;  // not admitted by a rule, or larger than a shard
+  uint64_t entries;
+  uint64_t bytes;
+  uint64_t capacity_bytes;
+};
+
+std::ostream& operator<< (std::ostream& out, const Cache_stats& stats);
+
+/*
+ * ResponseCache --
+ *
+ * Maps request fingerprints to responses.  Entries are spread over
+ * shards by fingerprint, each shard with its own lock, entry list and
+ * share of the byte budget.  When a shard is over budget it evicts by
+ * the configured policy.  Per-command rules decide whether responses
+ * are admitted at all and how long they stay valid.
+ *
+ * Keys are 64-bit fingerprints of the request string, computed once
+ * when the request arrives (see fingerprint()).  Two different
+ * requests colliding is possible but vanishingly unlikely.
+ */
+class ResponseCache {
+public:
+  ResponseCache(size_t capacity_bytes, int num_shards, Cache_policy policy);
+  ~ResponseCache();
+
+  static uint64_t fingerprint(const std::string& request_string);
+
+  // Only before the first insert.
+  void set_policy(Cache_policy policy);
+
+  // ttl_seconds <= 0 means the response never expires.
+  void set_rule(const std::string& cmd, bool admit, double ttl_seconds);
+  bool admits(const std::string& cmd) const;
+
+  bool lookup(uint64_t key, Response_msg& resp);
+  void insert(uint64_t key, const std::string& cmd, const Response_msg& resp);
+
+  Cache_stats stats();
+
+private:
+  struct Entry {
+    uint64_t key;
+    Response_msg resp;
+    double expires_at;  // 0 if never
+    size_t bytes;
+    bool referenced;    // CLOCK only
+  };
+
+  struct Shard {
+    pthread_mutex_t lock;
+    std::list<Entry> entries;  // LRU: most recent first; CLOCK: ring
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    std::list<Entry>::iterator hand;
+    size_t bytes;
+    size_t capacity;
+    Cache_stats stats;
+  };
+
+  struct Rule {
+    bool admit;
+    double ttl_seconds;
+  };
+
+  Cache_policy policy;
+  size_t capacity_bytes;
+  std::vector<Shard*> shards;
+  std::map<std::string, Rule> rules;
+
+  Shard* shard_for(uint64_t key) {
+    return shards[(key >> 32) % shards.size()];
+  }
+
+  void erase(Shard* shard, std::list<Entry>::iterator it);
+  void evict_one(Shard* shard);
+};
+
+#endif  // __MYSERVER_RESPONSE_CACHE_H__
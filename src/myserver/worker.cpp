@@ -5,20 +5,162 @@
 #include <sstream>
 #include <glog/logging.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
 
 #include "server/messages.h"
 #include "server/worker.h"
 #include "tools/cycle_timer.h"
-#include "tools/work_queue.h"
+#include "tools/work_stealing_pool.h"
+#include "cpu_topology.h"
+#include "prime_index.h"
+#include "prime_ranges.h"
+#include "resource_governor.h"
 
 #define MAX_THREADS 48
+// general pool threads: everything but the main thread and the
+// tellmenow lane
+#define NUM_POOL_THREADS (MAX_THREADS - 2)
+#define NUM_PRIORITY_THREADS 1
+// each pool task of a countprimes request sieves a range this long,
+// i.e. 256 KB of flags (one per odd number): about the size of L2
+#define COUNTPRIMES_BLOCK (512 * 1024)
+// slots granted to the master in pull mode: enough pool requests to
+// keep every hardware thread busy while the next one is on its way, a
+// projectidea slot per LLC, and a few tellmenow
+#define PULL_CPU_SLOTS_PER_CONTEXT 2
+#define PULL_LIGHT_SLOTS 8
+// jobs of each resource class a node runs at once.  One projectidea
+// working set fills an LLC, and one streaming job is enough to
+// saturate memory bandwidth; a streaming job would also flush a
+// projectidea's working set, so the two never run together.  ALU jobs
+// are limited only by the pool
+#define LLC_SLOTS_PER_DOMAIN 1
+#define BANDWIDTH_SLOTS 1
+
+// resource classes a slot is granted for
+enum Slot_class { SLOT_CPU, SLOT_CACHE, SLOT_LIGHT };
+
+//a request that has not been answered yet
+struct Live_request {
+  Slot_class cls;  //so its slot can be granted again (pull mode)
+  bool started;    //a thread has picked it up (so it can't be returned)
+  double started_at;  //when, to report its run time to the master
+  //tells this dispatch of the tag from an earlier one that a drain
+  //handed back: that one's queue entry is still there
+  uint64_t dispatch;
+  //set when the master no longer needs the answer.  Shared with the
+  //tasks running the request, which poll it
+  std::shared_ptr<Cancel_token> cancel;
+};
 
 static struct Worker_state {
-  WorkQueue<Request_msg> reqQueue;
-  WorkQueue<Request_msg> projectideaQueue;
-  WorkQueue<Request_msg> tellmenowQueue;
+  WorkStealingPool pool;
+  ResourceGovernor governor;
+  PrimeIndex primeIndex;
+
+  CpuTopology topology;
+  pthread_mutex_t domain_lock;
+  std::vector<int> domain_jobs;  //placed jobs running in each LLC domain
+
+  bool pull;
+  pthread_mutex_t live_lock;
+  std::unordered_map<int, Live_request> live_requests;
+  uint64_t next_dispatch;
 } wstate;
 
+static std::shared_ptr<Cancel_token> cancel_token_of(int tag) {
+  pthread_mutex_lock(&wstate.live_lock);
+  std::shared_ptr<Cancel_token> cancel = wstate.live_requests.at(tag).cancel;
+  pthread_mutex_unlock(&wstate.live_lock);
+  return cancel;
+}
+
+// Sends the response, with how long the request ran (since a thread
+// picked it up, so not counting its wait in the queues), and in pull
+// mode grants the slot it held back to the master.  A cancelled
+// request may have stopped part way, so it is answered with an empty
+// response whatever it computed.  A response for a dispatch that is no
+// longer live is dropped.
+static void reply(const Response_msg& resp, uint64_t dispatch) {
+  int tag = resp.get_tag();
+  pthread_mutex_lock(&wstate.live_lock);
+  auto it = wstate.live_requests.find(tag);
+  if (it == wstate.live_requests.end() || it->second.dispatch != dispatch) {
+    pthread_mutex_unlock(&wstate.live_lock);
+    LOG(WARNING) << "Dropping response to stale dispatch of " << tag;
+    return;
+  }
+  Live_request live = it->second;
+  wstate.live_requests.erase(it);
+  pthread_mutex_unlock(&wstate.live_lock);
+  if (live.cancel->load()) {
+    worker_send_response(Response_msg(tag));
+  }
+  else {
+    Response_msg timed(resp);
+    timed.set_run_seconds(CycleTimer::currentSeconds() - live.started_at);
+    worker_send_response(timed);
+  }
+  if (wstate.pull) {
+    Slot_class cls = live.cls;
+    worker_grant_slots(cls == SLOT_CPU, cls == SLOT_CACHE, cls == SLOT_LIGHT);
+  }
+}
+
+// Called by the thread that picked up a request, before running it.
+// Returns false if the request must not run: it was handed back to the
+// master by a drain (and may since have been sent here again, as a new
+// dispatch with its own queue entry), or it was cancelled (it is
+// answered with an empty response then).
+static bool start_request(int tag, uint64_t dispatch) {
+  pthread_mutex_lock(&wstate.live_lock);
+  auto it = wstate.live_requests.find(tag);
+  if (it == wstate.live_requests.end() || it->second.dispatch != dispatch) {
+    pthread_mutex_unlock(&wstate.live_lock);
+    return false;
+  }
+  it->second.started = true;
+  it->second.started_at = CycleTimer::currentSeconds();
+  bool cancelled = it->second.cancel->load();
+  pthread_mutex_unlock(&wstate.live_lock);
+  if (cancelled) {
+    Response_msg resp(tag);
+    reply(resp, dispatch);
+  }
+  return !cancelled;
+}
+
+//partial results of a compareprimes request whose four countprimes
+//calls run as separate (stealable) pool tasks
+struct Compareprimes_job {
+  int tag;
+  uint64_t dispatch;
+  int counts[4];
+  std::atomic<int> num_remaining;
+};
+
+//running total of a prime count that was split into blocks
+struct Range_count_job {
+  std::atomic<int> count;
+  std::atomic<int> num_remaining;
+  std::function<void(int)> done;
+};
+
+//weighted sum of the range counts a compareprimes request reduces to
+struct Compareprimes_ranges_job {
+  int tag;
+  uint64_t dispatch;
+  std::atomic<int> diff;
+  std::atomic<int> num_remaining;
+};
+
 
 // Generate a valid 'countprimes' request dictionary from integer 'n'
 static void create_computeprimes_req(Request_msg& req, int n) {
@@ -28,81 +170,259 @@ static void create_computeprimes_req(Request_msg& req, int n) {
   req.set_arg("n", oss.str());
 }
 
+// Answers countprimes(n) from the shared prime index.  Returns -1 if
+// n is beyond what the index covers so far (asking it to grow, in the
+// background), or if the reference trial division engine was selected.
+static int indexed_countprimes(int n) {
+  if (!countprimes_engine_is_sieve()) {
+    return -1;
+  }
+  if (n < 2) {
+    return 0;
+  }
+  // execute_work counts the primes in [2, max(n, 3))
+  return wstate.primeIndex.count_in_range(2, (n > 3) ? n : 3);
+}
+
+static void finish_compareprimes(Compareprimes_job* job) {
+  Response_msg resp(job->tag);
+  if (job->counts[1]-job->counts[0] > job->counts[3]-job->counts[2])
+    resp.set_response("There are more primes in first range.");
+  else
+    resp.set_response("There are more primes in second range.");
+  reply(resp, job->dispatch);
+  delete job;
+}
+
 // Implements logic required by compareprimes command via multiple
-// calls to execute_work.  This function fills in the appropriate
-// response.
-static void execute_compareprimes(const Request_msg& req, Response_msg& resp) {
+// calls to execute_work.  Each call is spawned onto this thread's
+// deque so idle threads can steal them; whichever task finishes last
+// sends the response.
+static void execute_compareprimes(const Request_msg& req, uint64_t dispatch) {
 
     int params[4];
-    int counts[4];
+    Compareprimes_job* job = new Compareprimes_job();
+    job->tag = req.get_tag();
+    job->dispatch = dispatch;
+    std::shared_ptr<Cancel_token> cancel = cancel_token_of(job->tag);
+    job->num_remaining.store(4);
 
     // grab the four arguments defining the two ranges
-    params[0] = atoi(req.get_arg("n1").c_str());
-    params[1] = atoi(req.get_arg("n2").c_str());
-    params[2] = atoi(req.get_arg("n3").c_str());
-    params[3] = atoi(req.get_arg("n4").c_str());
+    params[0] = req.get_int_arg(ARG_N1);
+    params[1] = req.get_int_arg(ARG_N2);
+    params[2] = req.get_int_arg(ARG_N3);
+    params[3] = req.get_int_arg(ARG_N4);
 
     for (int i=0; i<4; i++) {
-      Request_msg dummy_req(0);
-      Response_msg dummy_resp(0);
-      create_computeprimes_req(dummy_req, params[i]);
-      execute_work(dummy_req, dummy_resp);
-      counts[i] = atoi(dummy_resp.get_response().c_str());
+      int n = params[i];
+      wstate.pool.spawn([job, i, n, cancel]() {
+        Request_msg dummy_req(0);
+        Response_msg dummy_resp(0);
+        create_computeprimes_req(dummy_req, n);
+        execute_work(dummy_req, dummy_resp, cancel.get());
+        job->counts[i] = atoi(dummy_resp.get_response().c_str());
+        if (job->num_remaining.fetch_sub(1) == 1) {
+          finish_compareprimes(job);
+        }
+      });
     }
+}
+
+// Counts the primes in [lo, hi) and passes the count to 'done', which
+// runs on whichever thread finishes last.  The prime index answers if
+// it already covers hi (it is not grown for a range: that would sieve
+// everything below it).  Otherwise the range is cut into
+// COUNTPRIMES_BLOCK sized pieces that are sieved as separate pool
+// tasks.  Once 'cancel' is set the remaining pieces are skipped (and
+// the count passed to 'done' is meaningless).
+static void count_range(int lo, int hi, std::shared_ptr<Cancel_token> cancel,
+                        std::function<void(int)> done) {
+  if (hi <= lo) {
+    done(0);
+    return;
+  }
+  if (hi < wstate.primeIndex.bound()) {
+    done(wstate.primeIndex.count_in_range(lo, hi));
+    return;
+  }
+
+  int num_blocks = ((int64_t)hi - lo + COUNTPRIMES_BLOCK - 1) / COUNTPRIMES_BLOCK;
+  Range_count_job* job = new Range_count_job();
+  job->count.store(0);
+  job->num_remaining.store(num_blocks);
+  job->done = done;
 
-    if (counts[1]-counts[0] > counts[3]-counts[2])
+  for (int i = 0; i < num_blocks; i++) {
+    int block_lo = lo + (int64_t)i * COUNTPRIMES_BLOCK;
+    int block_hi = std::min<int64_t>(hi, (int64_t)block_lo + COUNTPRIMES_BLOCK);
+    wstate.pool.spawn([job, block_lo, block_hi, cancel]() {
+      if (!cancel->load(std::memory_order_relaxed)) {
+        job->count.fetch_add(count_primes_in_range(block_lo, block_hi));
+      }
+      if (job->num_remaining.fetch_sub(1) == 1) {
+        job->done(job->count.load());
+        delete job;
+      }
+    });
+  }
+}
+
+static void send_count(int tag, uint64_t dispatch, int count) {
+  char tmp_buffer[32];
+  sprintf(tmp_buffer, "%d", count);
+  Response_msg resp(tag);
+  resp.set_response(tmp_buffer);
+  reply(resp, dispatch);
+}
+
+// Answers compareprimes by counting only the pieces of the number
+// line its two ranges don't share (see compareprimes_ranges), rather
+// than four prefix counts from zero.
+static void execute_compareprimes_ranges(const Request_msg& req,
+                                         uint64_t dispatch) {
+  Prime_range ranges[MAX_COMPAREPRIMES_RANGES];
+  int num_ranges = compareprimes_ranges(req.get_int_arg(ARG_N1),
+                                        req.get_int_arg(ARG_N2),
+                                        req.get_int_arg(ARG_N3),
+                                        req.get_int_arg(ARG_N4),
+                                        ranges);
+
+  Compareprimes_ranges_job* job = new Compareprimes_ranges_job();
+  job->tag = req.get_tag();
+  job->dispatch = dispatch;
+  job->diff.store(0);
+  // one extra count so the job can't finish while ranges are still
+  // being started
+  job->num_remaining.store(num_ranges + 1);
+
+  auto finish = [job]() {
+    Response_msg resp(job->tag);
+    if (job->diff.load() > 0)
       resp.set_response("There are more primes in first range.");
     else
       resp.set_response("There are more primes in second range.");
+    reply(resp, job->dispatch);
+    delete job;
+  };
+  std::shared_ptr<Cancel_token> cancel = cancel_token_of(job->tag);
+  for (int i = 0; i < num_ranges; i++) {
+    int weight = ranges[i].weight;
+    count_range(ranges[i].lo, ranges[i].hi, cancel,
+                [job, weight, finish](int count) {
+      job->diff.fetch_add(weight * count);
+      if (job->num_remaining.fetch_sub(1) == 1) {
+        finish();
+      }
+    });
+  }
+  if (job->num_remaining.fetch_sub(1) == 1) {
+    finish();
+  }
 }
 
-void* projectidea_thread_start(void* args){
-  bool hasJob = false;
+// Answers countprimes from the prime index when possible (growing it
+// if needed), otherwise by sieving [2, max(n, 3)) in blocks.  Gives
+// exactly the answer execute_work would.
+static void execute_countprimes(const Request_msg& req, uint64_t dispatch) {
 
-  //since only one thread has this code we know if it's able to 
-  //pull of the queue then the system isn't running another projectidea
-  while(1){
-    //make use of the blocking queue
-    Request_msg req = wstate.projectideaQueue.get_work();
-    Response_msg resp(req.get_tag());
-    execute_work(req, resp);
-    worker_send_response(resp);
-  }
-}
+  int n = req.get_int_arg(ARG_N);
+  int tag = req.get_tag();
 
-//function for thread dedicated to tellmenow requests
-void* tellmenow_thread_start(void* args){
-  while(1){
-    Request_msg req = wstate.tellmenowQueue.get_work();
-    Response_msg resp(req.get_tag());
-    execute_work(req, resp);
-    worker_send_response(resp);
+  int indexed = indexed_countprimes(n);
+  if (indexed >= 0) {
+    send_count(tag, dispatch, indexed);
+    return;
   }
-  return NULL;
+  count_range(2, countprimes_bound(n), cancel_token_of(tag),
+              [tag, dispatch](int count) {
+    send_count(tag, dispatch, count);
+  });
 }
 
-void* general_thread_start(void* args){
-  while(1){
-    Request_msg req;
+// Internal command from the master: the number of primes in [lo, hi)
+static void execute_countprimesrange(const Request_msg& req, uint64_t dispatch) {
+  int tag = req.get_tag();
+  count_range(req.get_int_arg(ARG_LO), req.get_int_arg(ARG_HI),
+              cancel_token_of(tag), [tag, dispatch](int count) {
+    send_count(tag, dispatch, count);
+  });
+}
 
-    //queue is blocking so once we get past this point we know we must
-    //have a job to run
-    req = wstate.reqQueue.get_work();
-    
-    Response_msg resp(req.get_tag());
-    if (req.get_arg("cmd").compare("compareprimes") == 0) {
-      // The compareprimes command needs to be special cased since it is
-      // built on four calls to execute_execute work.  All other
-      // requests from the client are one-to-one with calls to  execute_work.
-      execute_compareprimes(req, resp);
-    } 
+//runs a request on whichever pool thread picked it up
+static void run_request(const Request_msg& req, uint64_t dispatch){
+  if (!start_request(req.get_tag(), dispatch)) {
+    return;
+  }
+  switch (req.get_cmd()) {
+  case CMD_COUNTPRIMESRANGE:
+    execute_countprimesrange(req, dispatch);
+    return;
+  case CMD_COMPAREPRIMES:
+    // The compareprimes command needs to be special cased since it is
+    // built on four calls to execute_execute work.  All other
+    // requests from the client are one-to-one with calls to  execute_work.
+    if (countprimes_engine_is_sieve()) {
+      execute_compareprimes_ranges(req, dispatch);
+    }
     else {
-      //The response string is filled in by 'execute_work'
-      execute_work(req, resp);
+      execute_compareprimes(req, dispatch);
     }
-    worker_send_response(resp);
+    return;
+  case CMD_COUNTPRIMES:
+    if (countprimes_engine_is_sieve()) {
+      execute_countprimes(req, dispatch);
+      return;
+    }
+    break;
+  default:
+    break;
   }
-  return NULL;
+
+  //The response string is filled in by 'execute_work'
+  Response_msg resp(req.get_tag());
+  execute_work(req, resp, cancel_token_of(req.get_tag()).get());
+  reply(resp, dispatch);
+}
+
+// The LLC domain with the fewest placed jobs in it, which the caller
+// now has a job in.  The governor's limits keep that at one each.
+static int claim_domain() {
+  pthread_mutex_lock(&wstate.domain_lock);
+  int best = 0;
+  for (int d = 1; d < wstate.topology.num_domains(); d++) {
+    if (wstate.domain_jobs[d] < wstate.domain_jobs[best]) {
+      best = d;
+    }
+  }
+  wstate.domain_jobs[best]++;
+  pthread_mutex_unlock(&wstate.domain_lock);
+  return best;
+}
+
+static void release_domain(int d) {
+  pthread_mutex_lock(&wstate.domain_lock);
+  wstate.domain_jobs[d]--;
+  pthread_mutex_unlock(&wstate.domain_lock);
+}
+
+// Runs a cache or bandwidth bound request inside an LLC domain of its
+// own: the pool thread moves onto the domain's cpus for the length of
+// the request, so the job's working set has the cache to itself and
+// the buffers it allocates are on the domain's memory node.
+static void run_placed(const Request_msg& req, uint64_t dispatch) {
+  int d = claim_domain();
+  cpu_set_t saved;
+  enter_domain(wstate.topology.domain(d), saved);
+  run_request(req, dispatch);
+  leave_domain(saved);
+  release_domain(d);
+}
+
+void worker_describe_resources(Worker_resources& resources) {
+  // the pool gets pinned to these cpus in worker_node_init
+  wstate.topology.discover();
+  resources.num_contexts = wstate.topology.thread_cpus().size();
+  resources.num_llc_domains = wstate.topology.num_domains();
 }
 
 void worker_node_init(const Request_msg& params) {
@@ -113,25 +433,43 @@ void worker_node_init(const Request_msg& params) {
   // processes will run on an instance with a dual-core CPU.
 
   DLOG(INFO) << "**** Initializing worker: " << params.get_arg("name") << " ****\n";
-  wstate.reqQueue = WorkQueue<Request_msg>();  
-  wstate.projectideaQueue = WorkQueue<Request_msg>();
-  wstate.tellmenowQueue = WorkQueue<Request_msg>();
-
-  pthread_t workers[MAX_THREADS];
-  // spawn 23 threads that will be pinned down to specific execution contexts
-  // use 23 because 24 execution contexts total and we have a main thread
-  for(int i = 0; i < MAX_THREADS - 1; i++){
-    //make 0th thread handle projectidea requests
-    if(i == 0){
-      pthread_create(&workers[i], NULL, projectidea_thread_start, NULL);
-    }
-    //make 1st thread handle tellmenow requests
-    else if(i == 1){
-      pthread_create(&workers[i], NULL, tellmenow_thread_start, NULL);
-    }
-    else{
-      pthread_create(&workers[i], NULL, general_thread_start, NULL);
-    }
+
+  // countprimes answers come from a prime index shared by all
+  // threads, which grows on the pool while the requests that need it
+  // are sieved.  If the master names a file, the index is loaded from
+  // it and saved back whenever it grows.
+  wstate.primeIndex.init(params.get_arg("prime_index_file"),
+                         [](PrimeIndex::Task task) {
+    wstate.pool.submit(task);
+  });
+
+  // everything runs on the work-stealing pool, with tellmenow on its
+  // priority lane.  Pool threads are pinned to execution contexts
+  // spread over the cores and caches of the node (discovered in
+  // worker_describe_resources).
+  int num_domains = wstate.topology.num_domains();
+  wstate.domain_jobs.assign(num_domains, 0);
+  pthread_mutex_init(&wstate.domain_lock, NULL);
+  wstate.pool.start(NUM_POOL_THREADS, NUM_PRIORITY_THREADS,
+                    wstate.topology.thread_cpus());
+
+  // the governor holds back jobs whose resource is taken, so the pool
+  // mixes complementary jobs
+  wstate.governor.set_limit(RES_LLC, LLC_SLOTS_PER_DOMAIN * num_domains);
+  wstate.governor.set_limit(RES_BANDWIDTH, BANDWIDTH_SLOTS);
+  wstate.governor.set_exclusive(RES_LLC, RES_BANDWIDTH);
+  wstate.governor.init([](ResourceGovernor::Task task) {
+    wstate.pool.submit(task);
+  });
+
+  // in pull mode the master sends nothing until slots are granted
+  wstate.pull = (params.get_arg("dispatch") == "pull");
+  pthread_mutex_init(&wstate.live_lock, NULL);
+  wstate.next_dispatch = 0;
+  if (wstate.pull) {
+    int num_contexts = wstate.topology.thread_cpus().size();
+    worker_grant_slots(PULL_CPU_SLOTS_PER_CONTEXT * num_contexts,
+                       LLC_SLOTS_PER_DOMAIN * num_domains, PULL_LIGHT_SLOTS);
   }
 }
 
@@ -141,14 +479,36 @@ void worker_handle_request(const Request_msg& req) {
 
 
   // Enqueue into correct queue based on type of job
-  if (req.get_arg("cmd").compare("projectidea") == 0) {
-    wstate.projectideaQueue.put_work(req);
+  Request_cmd cmd = req.get_cmd();
+  Slot_class cls = SLOT_CPU;
+  if (cmd == CMD_PROJECTIDEA) {
+    cls = SLOT_CACHE;
   }
-  else if(req.get_arg("cmd").compare("tellmenow") == 0){
-    wstate.tellmenowQueue.put_work(req);
+  else if(cmd == CMD_TELLMENOW){
+    cls = SLOT_LIGHT;
+  }
+  Live_request live;
+  live.cls = cls;
+  live.started = false;
+  live.started_at = 0;
+  live.cancel = std::make_shared<Cancel_token>(false);
+  pthread_mutex_lock(&wstate.live_lock);
+  uint64_t dispatch = wstate.next_dispatch++;
+  live.dispatch = dispatch;
+  wstate.live_requests[req.get_tag()] = live;
+  pthread_mutex_unlock(&wstate.live_lock);
+
+  if(cls == SLOT_LIGHT){
+    wstate.pool.submit_priority([req, dispatch]() { run_request(req, dispatch); });
   }
   else{
-    wstate.reqQueue.put_work(req);
+    Resource_class res = resource_class(cmd);
+    if (res == RES_CPU) {
+      wstate.governor.submit(res, [req, dispatch]() { run_request(req, dispatch); });
+    }
+    else {
+      wstate.governor.submit(res, [req, dispatch]() { run_placed(req, dispatch); });
+    }
   }
   // Output debugging help to the logs (in a single worker node
   // configuration, this would be in the log logs/worker.INFO)
@@ -156,3 +516,35 @@ void worker_handle_request(const Request_msg& req) {
 
   
 }
+
+void worker_handle_cancel(int tag) {
+  // a request that is running notices at its next poll of the token
+  // and returns its thread to the pool
+  pthread_mutex_lock(&wstate.live_lock);
+  auto it = wstate.live_requests.find(tag);
+  if (it != wstate.live_requests.end()) {
+    it->second.cancel->store(true);
+  }
+  pthread_mutex_unlock(&wstate.live_lock);
+}
+
+void worker_handle_drain() {
+  // requests still waiting in a queue go back to the master.  Their
+  // queue entries stay behind and are skipped by start_request, even
+  // if the master sends the same tag here again
+  std::vector<int> unstarted;
+  pthread_mutex_lock(&wstate.live_lock);
+  for (auto it = wstate.live_requests.begin(); it != wstate.live_requests.end(); ) {
+    if (it->second.started) {
+      ++it;
+      continue;
+    }
+    unstarted.push_back(it->first);
+    it = wstate.live_requests.erase(it);
+  }
+  pthread_mutex_unlock(&wstate.live_lock);
+
+  for (size_t i = 0; i < unstarted.size(); i++) {
+    worker_return_request(unstarted[i]);
+  }
+}